@@ -8,7 +8,15 @@
 
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace boost {
 namespace asio {
@@ -26,7 +34,20 @@ struct dir_monitor_event
         /**
          * In some cases a recursive scan of directory under dirname is required.
          */
-        recursive_rescan = 6
+        recursive_rescan = 6,
+        /**
+         * The kernel dropped events. Watched directories are resynced and the
+         * changes that were missed follow as added/removed/modified events.
+         */
+        overflow = 7,
+        /**
+         * Carries both names: old_path was renamed to path.
+         */
+        renamed = 8,
+        /**
+         * Permissions, ownership, timestamps or extended attributes changed.
+         */
+        metadata_changed = 9
     };
 
     dir_monitor_event()
@@ -35,6 +56,12 @@ struct dir_monitor_event
     dir_monitor_event(const boost::filesystem::path &p, event_type t)
         : path(p), type(t) { }
 
+    dir_monitor_event(const boost::filesystem::path &old_p, const boost::filesystem::path &p, event_type t)
+        : path(p), old_path(old_p), type(t) { }
+
+    dir_monitor_event(boost::filesystem::path &&old_p, boost::filesystem::path &&p, event_type t)
+        : path(std::move(p)), old_path(std::move(old_p)), type(t) { }
+
     const char* type_cstr() const
     {
         switch(type) {
@@ -44,20 +71,328 @@ struct dir_monitor_event
             case boost::asio::dir_monitor_event::renamed_old_name: return "RENAMED (OLD NAME)";
             case boost::asio::dir_monitor_event::renamed_new_name: return "RENAMED (NEW NAME)";
             case boost::asio::dir_monitor_event::recursive_rescan: return "RESCAN DIR";
+            case boost::asio::dir_monitor_event::overflow: return "OVERFLOW";
+            case boost::asio::dir_monitor_event::renamed: return "RENAMED";
+            case boost::asio::dir_monitor_event::metadata_changed: return "METADATA CHANGED";
             default: return "UNKNOWN";
         }
     }
 
     boost::filesystem::path path;
+    /**
+     * Previous name of path for renamed events, empty otherwise.
+     */
+    boost::filesystem::path old_path;
     event_type type;
 };
 
 inline std::ostream& operator << (std::ostream& os, dir_monitor_event const& ev)
 {
-    os << "dir_monitor_event " << ev.type_cstr() << " " << ev.path;
+    os << "dir_monitor_event " << ev.type_cstr() << " ";
+    if (ev.type == dir_monitor_event::renamed)
+        os << ev.old_path << " -> ";
+    os << ev.path;
     return os;
 }
 
+/**
+ * Order in which events of different directories are delivered: events of
+ * a higher class are handed out first, each class in the order it was
+ * reported.
+ */
+enum dir_monitor_priority
+{
+    priority_low,
+    priority_normal,
+    priority_high
+};
+
+/**
+ * A watched directory, shared by all compact events reported for it.
+ */
+struct dir_monitor_directory
+{
+    dir_monitor_directory(std::uint32_t i, const boost::filesystem::path &p, dir_monitor_priority pr = priority_normal)
+        : id(i), path(p), priority(pr) { }
+
+    /**
+     * Identifies the directory among those watched by one monitor.
+     */
+    std::uint32_t id;
+    boost::filesystem::path path;
+    /**
+     * Taken from the options the directory, or the directory it was found
+     * in, was added with.
+     */
+    dir_monitor_priority priority;
+};
+
+/**
+ * dir_monitor_event without per-event path allocations: the directory is
+ * interned and the leaf name is stored inline unless it is longer than
+ * inline_name_capacity bytes. path() builds the full path on demand, and
+ * converting to dir_monitor_event does the same.
+ */
+class compact_dir_monitor_event
+{
+public:
+    typedef dir_monitor_event::event_type event_type;
+    typedef std::shared_ptr<const dir_monitor_directory> directory_ptr;
+
+    enum { inline_name_capacity = 39 };
+
+    compact_dir_monitor_event()
+        : type(dir_monitor_event::null)
+    {
+        assign_name("", 0);
+    }
+
+    compact_dir_monitor_event(const directory_ptr &directory, const char *name, std::size_t name_size, event_type t)
+        : type(t), directory_(directory)
+    {
+        assign_name(name, name_size);
+    }
+
+    compact_dir_monitor_event(const directory_ptr &directory, const std::string &name, event_type t)
+        : type(t), directory_(directory)
+    {
+        assign_name(name.data(), name.size());
+    }
+
+    /**
+     * A renamed event: old_name in old_directory was renamed to name in directory.
+     */
+    compact_dir_monitor_event(const directory_ptr &old_directory, const char *old_name, std::size_t old_name_size,
+        const directory_ptr &directory, const char *name, std::size_t name_size, event_type t)
+        : type(t), directory_(directory), old_(new rename_source(old_directory, std::string(old_name, old_name_size)))
+    {
+        assign_name(name, name_size);
+    }
+
+    compact_dir_monitor_event(const compact_dir_monitor_event &other)
+        : type(other.type), directory_(other.directory_), old_(other.old_ ? new rename_source(*other.old_) : nullptr)
+    {
+        assign_name(other.name(), other.name_size_);
+    }
+
+    compact_dir_monitor_event(compact_dir_monitor_event &&other)
+        : type(other.type), directory_(std::move(other.directory_)), old_(std::move(other.old_))
+    {
+        take_name(other);
+    }
+
+    compact_dir_monitor_event &operator=(const compact_dir_monitor_event &other)
+    {
+        if (this != &other)
+        {
+            type = other.type;
+            directory_ = other.directory_;
+            old_.reset(other.old_ ? new rename_source(*other.old_) : nullptr);
+            assign_name(other.name(), other.name_size_);
+        }
+        return *this;
+    }
+
+    compact_dir_monitor_event &operator=(compact_dir_monitor_event &&other)
+    {
+        if (this != &other)
+        {
+            type = other.type;
+            directory_ = std::move(other.directory_);
+            old_ = std::move(other.old_);
+            take_name(other);
+        }
+        return *this;
+    }
+
+    /**
+     * The directory the event happened in; null for overflow events.
+     */
+    const directory_ptr &directory() const { return directory_; }
+
+    /**
+     * Leaf name, NUL-terminated; empty if the event is about the directory itself.
+     */
+    const char *name() const { return heap_name_ ? heap_name_.get() : inline_name_; }
+    std::size_t name_size() const { return name_size_; }
+
+    boost::filesystem::path path() const
+    {
+        if (!directory_)
+            return boost::filesystem::path(name());
+        if (name_size_ == 0)
+            return directory_->path;
+        return directory_->path / name();
+    }
+
+    /**
+     * Source of a renamed event; null directory and empty name otherwise.
+     */
+    directory_ptr old_directory() const { return old_ ? old_->directory : directory_ptr(); }
+    std::string old_name() const { return old_ ? old_->name : std::string(); }
+
+    boost::filesystem::path old_path() const
+    {
+        if (!old_)
+            return boost::filesystem::path();
+        if (!old_->directory)
+            return boost::filesystem::path(old_->name);
+        return old_->directory->path / old_->name;
+    }
+
+    const char* type_cstr() const
+    {
+        return dir_monitor_event(boost::filesystem::path(), type).type_cstr();
+    }
+
+    operator dir_monitor_event() const
+    {
+        return dir_monitor_event(old_path(), path(), type);
+    }
+
+    event_type type;
+
+private:
+    struct rename_source
+    {
+        rename_source(const directory_ptr &d, const std::string &n)
+            : directory(d), name(n) { }
+
+        directory_ptr directory;
+        std::string name;
+    };
+
+    void assign_name(const char *name, std::size_t size)
+    {
+        char *data = inline_name_;
+        if (size > inline_name_capacity)
+        {
+            heap_name_.reset(new char[size + 1]);
+            data = heap_name_.get();
+        }
+        else
+            heap_name_.reset();
+        std::memmove(data, name, size);
+        data[size] = '\0';
+        name_size_ = static_cast<std::uint32_t>(size);
+    }
+
+    void take_name(compact_dir_monitor_event &other)
+    {
+        heap_name_ = std::move(other.heap_name_);
+        name_size_ = other.name_size_;
+        if (!heap_name_)
+            std::memcpy(inline_name_, other.inline_name_, name_size_ + 1);
+        other.name_size_ = 0;
+        other.inline_name_[0] = '\0';
+    }
+
+    directory_ptr directory_;
+    std::unique_ptr<rename_source> old_;
+    std::unique_ptr<char[]> heap_name_;
+    std::uint32_t name_size_;
+    char inline_name_[inline_name_capacity + 1];
+};
+
+inline std::ostream& operator << (std::ostream& os, compact_dir_monitor_event const& ev)
+{
+    return os << static_cast<dir_monitor_event>(ev);
+}
+
+/**
+ * Selects which changes add_directory() reports for a directory and its
+ * subdirectories. Backends subscribe to as little as they can.
+ */
+struct dir_monitor_options
+{
+    enum event_class
+    {
+        /** added and removed */
+        created_removed = 1,
+        /** renamed_old_name/renamed_new_name, or renamed */
+        renames = 2,
+        /** modified on every write */
+        modifications = 4,
+        /** modified once a file opened for writing is closed */
+        close_write = 8,
+        /** metadata_changed */
+        attributes = 16,
+        default_events = created_removed | renames | modifications
+    };
+
+    dir_monitor_options()
+        : events(default_events), priority(priority_normal), poll_interval(0) { }
+
+    explicit dir_monitor_options(unsigned e, dir_monitor_priority p = priority_normal)
+        : events(e), priority(p), poll_interval(0) { }
+
+    unsigned events;
+    /**
+     * Subdirectories, including those that appear later, share it.
+     */
+    dir_monitor_priority priority;
+    /**
+     * Non-zero has the inotify backend list the directory tree this often
+     * and report the differences, as the polling backend does, for file
+     * systems inotify does not cover (NFS, FUSE, some overlay mounts).
+     * With the polling backend it overrides the interval of the monitor.
+     * Polling reports no renames, only removals and additions.
+     */
+    std::chrono::milliseconds poll_interval;
+};
+
+/**
+ * What a bounded event queue does with events once it is full.
+ */
+enum dir_monitor_queue_policy
+{
+    /** The oldest queued event is dropped to make room. */
+    queue_drop_oldest,
+    /**
+     * Events are held outside the queue, at most one per path: repeats
+     * merge as with coalescing, and modified after added stays added.
+     */
+    queue_coalesce_per_path,
+    /**
+     * Events are collapsed into one recursive_rescan event per directory,
+     * whose path is the directory.
+     */
+    queue_rescan_directory,
+    /**
+     * Reading stops once the queue is full: the records already read wait
+     * in the read buffer, the rest in the kernel queue, which may overflow
+     * in turn. Events that are not read (expired renames, resyncs) and, with
+     * several inotify instances, the records the others read before they
+     * stop wait outside the queue in order. A shared inotify instance stops
+     * for every monitor.
+     */
+    queue_backpressure
+};
+
+/**
+ * Snapshot of how the kernel event queue has been read so far.
+ */
+struct dir_monitor_read_statistics
+{
+    /**
+     * histogram[i] counts reads that returned between 2^i and 2^(i+1) - 1 bytes;
+     * the last bucket also counts anything larger.
+     */
+    std::array<std::uint64_t, 20> histogram;
+    std::uint64_t reads;
+    std::uint64_t bytes;
+    /**
+     * Reads that left no room for another record; each one grows the buffer
+     * until the configured maximum is reached.
+     */
+    std::uint64_t full_reads;
+    /**
+     * Round trips through the reactor; every other read drained the descriptor.
+     */
+    std::uint64_t reactor_reads;
+    std::size_t buffer_capacity;
+};
+
 template <typename Service>
 class basic_dir_monitor
     : public boost::asio::basic_io_object<Service>
@@ -73,11 +408,158 @@ public:
         this->get_service().add_directory(this->get_implementation(), dirname);
     }
 
+    void add_directory(const std::string &dirname, const dir_monitor_options &options)
+    {
+        this->get_service().add_directory(this->get_implementation(), dirname, options);
+    }
+
+    /**
+     * Watches dirname and its subdirectories without blocking the calling
+     * thread. Calls handler(const boost::system::error_code &, std::size_t directories)
+     * once all directories are watched. Supported by the inotify backend.
+     */
+    template <typename Handler>
+    void async_add_directory(const std::string &dirname, const dir_monitor_options &options, Handler handler)
+    {
+        this->get_service().async_add_directory(this->get_implementation(), dirname, options, [](std::size_t) {}, handler);
+    }
+
+    /**
+     * As above, also calling progress(std::size_t directories) every so many
+     * directories while the tree is being walked.
+     */
+    template <typename ProgressHandler, typename Handler>
+    void async_add_directory(const std::string &dirname, const dir_monitor_options &options, ProgressHandler progress, Handler handler)
+    {
+        this->get_service().async_add_directory(this->get_implementation(), dirname, options, progress, handler);
+    }
+
     void remove_directory(const std::string &dirname)
     {
         this->get_service().remove_directory(this->get_implementation(), dirname);
     }
 
+    /**
+     * dirname and every directory watched below it, parents first; empty if
+     * dirname is not watched. Answered from memory. Supported by the inotify backend.
+     */
+    std::vector<std::string> watched_directories(const std::string &dirname)
+    {
+        return this->get_service().watched_directories(this->get_implementation(), dirname);
+    }
+
+    /**
+     * Tunes how much is read from the kernel at once. Supported by the inotify backend.
+     */
+    void set_read_buffer_size(std::size_t initial_size, std::size_t max_size)
+    {
+        this->get_service().set_read_buffer_size(this->get_implementation(), initial_size, max_size);
+    }
+
+    /**
+     * Reports renames as single renamed events. The old name of a rename
+     * whose new name has not been read within timeout, or whose path
+     * changes again first, is reported as removed; a new name without an
+     * old one as added. A zero timeout (the default) keeps
+     * renamed_old_name/renamed_new_name. Supported by the inotify backend.
+     */
+    void set_rename_pairing(std::chrono::milliseconds timeout)
+    {
+        this->get_service().set_rename_pairing(this->get_implementation(), timeout);
+    }
+
+    /**
+     * Holds events back until their path has been quiet for quiet_window and
+     * merges repeats of the same event on a path, optionally folding
+     * modifications into a pending added. A zero window (the default) turns
+     * coalescing off. Supported by the inotify backend.
+     */
+    void set_coalescing(std::chrono::milliseconds quiet_window, bool collapse_added_modified = false)
+    {
+        this->get_service().set_coalescing(this->get_implementation(), quiet_window, collapse_added_modified);
+    }
+
+    /**
+     * Bounds the event queue to capacity events; zero, the default, leaves
+     * it unbounded. policy decides what happens to events once it is full.
+     * Held back events are queued, and reading resumes, once consumers have
+     * taken half of the queue. Supported by the inotify backend.
+     */
+    void set_queue_limit(std::size_t capacity, dir_monitor_queue_policy policy = queue_drop_oldest)
+    {
+        this->get_service().set_queue_limit(this->get_implementation(), capacity, policy);
+    }
+
+    /**
+     * Posts handler(std::size_t queued) when the event queue grows to events
+     * events, and again whenever it gets there after having been found
+     * below, so that consumers can shed load before events are lost. Zero
+     * turns this off. Supported by the inotify backend.
+     */
+    template <typename Handler>
+    void set_high_watermark(std::size_t events, Handler handler)
+    {
+        this->get_service().set_high_watermark(this->get_implementation(), events, handler);
+    }
+
+    /**
+     * How often the directories are listed, unless added with a
+     * poll_interval of their own; see dir_monitor_options. Supported by the
+     * polling backend.
+     */
+    void set_poll_interval(std::chrono::milliseconds interval)
+    {
+        this->get_service().set_poll_interval(this->get_implementation(), interval);
+    }
+
+    /**
+     * Spreads the watched directories over count inotify instances, each
+     * read by a thread of its own, multiplying the kernel queue and the
+     * parsing throughput. Each directory added goes to one instance along
+     * with its subdirectories, so the events of a directory keep their
+     * order; renames between directories on different instances are not
+     * paired. Must be called before any directory is added and before the
+     * other settings. Supported by the inotify backend with
+     * inotify_per_monitor; other modes ignore it.
+     */
+    void set_inotify_instances(std::size_t count)
+    {
+        this->get_service().set_inotify_instances(this->get_implementation(), count);
+    }
+
+    /**
+     * Events are handed out by the priority of their directory (see
+     * dir_monitor_options::priority). With a non-zero limit, events of a
+     * lower priority that have waited while limit events of higher ones
+     * were taken in a row get the next turn. Supported by the inotify
+     * backend.
+     */
+    void set_starvation_limit(std::size_t limit)
+    {
+        this->get_service().set_starvation_limit(this->get_implementation(), limit);
+    }
+
+    /**
+     * Runs the handlers of asynchronous calls through strands strands, picked
+     * per event by a hash of its path (or of its directory, with
+     * by_directory): handlers for one file stay in order while unrelated
+     * files are handled in parallel by the threads running the io_service.
+     * A batch only holds events for one strand. Zero strands (the default)
+     * turn this off. Supported by the inotify backend.
+     */
+    void set_dispatch_strands(std::size_t strands, bool by_directory = false)
+    {
+        this->get_service().set_dispatch_strands(this->get_implementation(), strands, by_directory);
+    }
+
+    /**
+     * Read-size distribution of the kernel event queue. Supported by the inotify backend.
+     */
+    dir_monitor_read_statistics read_statistics()
+    {
+        return this->get_service().read_statistics(this->get_implementation());
+    }
+
     dir_monitor_event monitor()
     {
         boost::system::error_code ec;
@@ -91,11 +573,210 @@ public:
         return this->get_service().monitor(this->get_implementation(), ec);
     }
 
-    template <typename Handler>
-    void async_monitor(Handler handler)
+    /**
+     * The oldest queued event, or nothing if none is queued; never waits,
+     * so it can be polled, e.g. once per frame. Once the monitor is
+     * destroyed ec is set to operation_aborted.
+     */
+    boost::optional<dir_monitor_event> try_monitor(boost::system::error_code &ec)
+    {
+        return this->get_service().try_monitor(this->get_implementation(), ec);
+    }
+
+    boost::optional<dir_monitor_event> try_monitor()
+    {
+        boost::system::error_code ec;
+        boost::optional<dir_monitor_event> ev = this->get_service().try_monitor(this->get_implementation(), ec);
+        boost::asio::detail::throw_error(ec);
+        return ev;
+    }
+
+    /**
+     * Like monitor() but waits at most timeout, returning nothing if no
+     * event arrived meanwhile.
+     */
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> monitor_for(const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        return this->get_service().monitor_for(this->get_implementation(), timeout, ec);
+    }
+
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> monitor_for(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        boost::system::error_code ec;
+        boost::optional<dir_monitor_event> ev = this->get_service().monitor_for(this->get_implementation(), timeout, ec);
+        boost::asio::detail::throw_error(ec);
+        return ev;
+    }
+
+    /**
+     * Moves up to max_events queued events, as dir_monitor_event, to out
+     * without waiting and returns out past the last one. The inotify queue
+     * is taken from without a lock, the others under a single one.
+     */
+    template <typename OutputIterator>
+    OutputIterator drain(OutputIterator out, std::size_t max_events)
+    {
+        return this->get_service().drain(this->get_implementation(), out, max_events);
+    }
+
+    /**
+     * Calls handler(const boost::system::error_code &, const dir_monitor_event &).
+     * Takes any completion token, e.g. boost::asio::use_future, or
+     * boost::asio::use_awaitable in a coroutine:
+     *
+     *   dir_monitor_event ev = co_await dm.async_monitor(boost::asio::use_awaitable);
+     *
+     * With the inotify and polling backends the handler is only moved, so
+     * it may be move-only, its associated allocator is used for the
+     * operation, and it runs on its associated executor.
+     */
+    template <typename CompletionToken>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void (boost::system::error_code, dir_monitor_event))
+    async_monitor(BOOST_ASIO_MOVE_ARG(CompletionToken) token)
+    {
+        return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, dir_monitor_event)>(
+            initiate_async_monitor(this), token);
+    }
+
+    /**
+     * Completes every pending asynchronous monitor call with
+     * operation_aborted. Watches and queued events are kept, so the next
+     * call picks up where the cancelled one left off. A single call can be
+     * cancelled through the cancellation slot associated with its handler
+     * (Boost 1.77 or later). Supported by the inotify and polling backends.
+     */
+    void cancel()
+    {
+        this->get_service().cancel(this->get_implementation());
+    }
+
+    /**
+     * Like monitor() but the path is only built if the caller asks for it.
+     * Supported by the inotify backend.
+     */
+    compact_dir_monitor_event monitor_compact()
+    {
+        boost::system::error_code ec;
+        compact_dir_monitor_event ev = this->get_service().monitor_compact(this->get_implementation(), ec);
+        boost::asio::detail::throw_error(ec);
+        return ev;
+    }
+
+    compact_dir_monitor_event monitor_compact(boost::system::error_code &ec)
+    {
+        return this->get_service().monitor_compact(this->get_implementation(), ec);
+    }
+
+    /**
+     * Calls handler(const boost::system::error_code &, const compact_dir_monitor_event &).
+     * Takes any completion token. Supported by the inotify backend.
+     */
+    template <typename CompletionToken>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void (boost::system::error_code, compact_dir_monitor_event))
+    async_monitor_compact(BOOST_ASIO_MOVE_ARG(CompletionToken) token)
+    {
+        return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, compact_dir_monitor_event)>(
+            initiate_async_monitor_compact(this), token);
+    }
+
+    /**
+     * Blocks until at least one event is queued and returns up to max_events.
+     * Supported by the inotify backend.
+     */
+    std::vector<dir_monitor_event> monitor_batch(std::size_t max_events)
+    {
+        boost::system::error_code ec;
+        std::vector<dir_monitor_event> events = this->get_service().monitor_batch(this->get_implementation(), max_events, ec);
+        boost::asio::detail::throw_error(ec);
+        return events;
+    }
+
+    std::vector<dir_monitor_event> monitor_batch(std::size_t max_events, boost::system::error_code &ec)
+    {
+        return this->get_service().monitor_batch(this->get_implementation(), max_events, ec);
+    }
+
+    /**
+     * Calls handler(const boost::system::error_code &, const std::vector<dir_monitor_event> &)
+     * once with up to max_events events. Takes any completion token, so a
+     * coroutine can await whole batches. Supported by the inotify backend.
+     */
+    template <typename CompletionToken>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void (boost::system::error_code, std::vector<dir_monitor_event>))
+    async_monitor_batch(std::size_t max_events, BOOST_ASIO_MOVE_ARG(CompletionToken) token)
     {
-        this->get_service().async_monitor(this->get_implementation(), handler);
+        return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, std::vector<dir_monitor_event>)>(
+            initiate_async_monitor_batch(this), token, max_events);
     }
+
+    /**
+     * monitor_batch() for compact events. Supported by the inotify backend.
+     */
+    std::vector<compact_dir_monitor_event> monitor_batch_compact(std::size_t max_events)
+    {
+        boost::system::error_code ec;
+        std::vector<compact_dir_monitor_event> events = this->get_service().monitor_batch_compact(this->get_implementation(), max_events, ec);
+        boost::asio::detail::throw_error(ec);
+        return events;
+    }
+
+    std::vector<compact_dir_monitor_event> monitor_batch_compact(std::size_t max_events, boost::system::error_code &ec)
+    {
+        return this->get_service().monitor_batch_compact(this->get_implementation(), max_events, ec);
+    }
+
+private:
+    // Start the asynchronous calls once async_initiate has turned the
+    // completion token into a handler.
+    class initiate_async_monitor
+    {
+    public:
+        explicit initiate_async_monitor(basic_dir_monitor *self)
+            : self_(self) { }
+
+        template <typename Handler>
+        void operator()(BOOST_ASIO_MOVE_ARG(Handler) handler) const
+        {
+            self_->get_service().async_monitor(self_->get_implementation(), std::forward<Handler>(handler));
+        }
+
+    private:
+        basic_dir_monitor *self_;
+    };
+
+    class initiate_async_monitor_compact
+    {
+    public:
+        explicit initiate_async_monitor_compact(basic_dir_monitor *self)
+            : self_(self) { }
+
+        template <typename Handler>
+        void operator()(BOOST_ASIO_MOVE_ARG(Handler) handler) const
+        {
+            self_->get_service().async_monitor_compact(self_->get_implementation(), std::forward<Handler>(handler));
+        }
+
+    private:
+        basic_dir_monitor *self_;
+    };
+
+    class initiate_async_monitor_batch
+    {
+    public:
+        explicit initiate_async_monitor_batch(basic_dir_monitor *self)
+            : self_(self) { }
+
+        template <typename Handler>
+        void operator()(BOOST_ASIO_MOVE_ARG(Handler) handler, std::size_t max_events) const
+        {
+            self_->get_service().async_monitor_batch(self_->get_implementation(), max_events, std::forward<Handler>(handler));
+        }
+
+    private:
+        basic_dir_monitor *self_;
+    };
 };
 
 }
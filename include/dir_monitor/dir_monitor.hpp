@@ -20,12 +20,34 @@
 #else
 #  error "Platform not supported."
 #endif
+#include "polling/basic_dir_monitor_service.hpp"
 
 namespace boost {
 namespace asio {
 
 typedef basic_dir_monitor<basic_dir_monitor_service<> > dir_monitor;
 
+/**
+ * A dir_monitor that lists its directories periodically instead of asking
+ * the operating system, for file systems that report no changes; see
+ * polling_dir_monitor_impl.
+ */
+typedef basic_dir_monitor<basic_polling_dir_monitor_service<> > polling_dir_monitor;
+
+#if (BOOST_OS_LINUX || BOOST_OS_ANDROID)
+/**
+ * A dir_monitor whose instances on one io_service share a single inotify
+ * instance and reader thread, for programs running many monitors.
+ */
+typedef basic_dir_monitor<basic_dir_monitor_service<dir_monitor_impl, inotify_per_service> > shared_dir_monitor;
+
+/**
+ * A dir_monitor run entirely by the threads running its io_service, with
+ * no threads of its own; see inotify_inline.
+ */
+typedef basic_dir_monitor<basic_dir_monitor_service<dir_monitor_impl, inotify_inline> > inline_dir_monitor;
+#endif
+
 }
 }
 
@@ -0,0 +1,225 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "basic_dir_monitor.hpp"
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace boost {
+namespace asio {
+
+/**
+ * Holds events back for a quiet window and merges repeats on the same path.
+ *
+ * At most one event per path is pending. A repeat of the pending type (or a
+ * modified following an added, if collapse_added_modified is set) restarts
+ * the quiet window instead of queueing another event. Any other event for the
+ * path releases the pending one first, so per-path order is kept. An event is
+ * held for at most max_hold_windows() quiet windows even if its path never goes
+ * quiet, e.g. a log file being appended to.
+ *
+ * Not thread-safe; the owning backend drives it from its event thread.
+ */
+class dir_monitor_event_coalescer
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static int max_hold_windows() { return 10; }
+
+    dir_monitor_event_coalescer()
+        : quiet_window_(0),
+        collapse_added_modified_(false)
+    {
+    }
+
+    /**
+     * A zero quiet_window disables coalescing; flush() whatever is pending then.
+     */
+    void configure(std::chrono::milliseconds quiet_window, bool collapse_added_modified)
+    {
+        quiet_window_ = quiet_window;
+        collapse_added_modified_ = collapse_added_modified;
+    }
+
+    bool enabled() const { return quiet_window_.count() != 0; }
+
+    bool empty() const { return pending_.empty(); }
+
+    /**
+     * Takes ev, handing sink(const compact_dir_monitor_event &) anything that
+     * must go out before it. Returns true if ev became or merged into a
+     * pending event.
+     */
+    template <typename Sink>
+    bool push(const compact_dir_monitor_event &ev, clock::time_point now, Sink sink)
+    {
+        if (!coalescable(ev.type))
+        {
+            if (ev.old_directory())
+            {
+                const std::string old_name = ev.old_name();
+                release(key_t(ev.old_directory()->id, old_name), sink);
+            }
+            release(key_of(ev), sink);
+            return false;
+        }
+
+        index_t::iterator it = index_.find(key_of(ev));
+        if (it != index_.end())
+        {
+            pending_event &pending = *it->second;
+            if (pending.event.type == ev.type ||
+                (collapse_added_modified_ && pending.event.type == dir_monitor_event::added && ev.type == dir_monitor_event::modified))
+            {
+                pending.deadline = (std::min)(now + quiet_window_, pending.release_by);
+                requeue(it->second);
+                return true;
+            }
+
+            sink(pending.event);
+            pending_.erase(it->second);
+            index_.erase(it);
+        }
+
+        pending_event pending = { ev, now + quiet_window_, now + quiet_window_ * max_hold_windows() };
+        pending_t::iterator inserted = pending_.insert(pending_.end(), pending);
+        requeue(inserted);
+        // The key refers to the name held by the list node, which stays put.
+        index_[key_of(inserted->event)] = inserted;
+        return true;
+    }
+
+    /**
+     * Hands sink every event whose quiet window has passed, in the order
+     * they fell due. Returns when the next pending event is due, or
+     * clock::time_point::max().
+     */
+    template <typename Sink>
+    clock::time_point expire(clock::time_point now, Sink sink)
+    {
+        while (!pending_.empty() && pending_.front().deadline <= now)
+        {
+            sink(pending_.front().event);
+            index_.erase(key_of(pending_.front().event));
+            pending_.pop_front();
+        }
+        return pending_.empty() ? clock::time_point::max() : pending_.front().deadline;
+    }
+
+    /**
+     * Hands sink everything that is pending, soonest due first.
+     */
+    template <typename Sink>
+    void flush(Sink sink)
+    {
+        for (const auto &pending : pending_)
+            sink(pending.event);
+        pending_.clear();
+        index_.clear();
+    }
+
+    /**
+     * Hands sink at most max_events pending events, soonest due first.
+     * Returns how many it handed over.
+     */
+    template <typename Sink>
+    std::size_t flush(Sink sink, std::size_t max_events)
+    {
+        std::size_t count = 0;
+        for (; count < max_events && !pending_.empty(); ++count)
+        {
+            sink(pending_.front().event);
+            index_.erase(key_of(pending_.front().event));
+            pending_.pop_front();
+        }
+        return count;
+    }
+
+private:
+    static bool coalescable(dir_monitor_event::event_type type)
+    {
+        return type == dir_monitor_event::added || type == dir_monitor_event::removed ||
+            type == dir_monitor_event::modified || type == dir_monitor_event::metadata_changed;
+    }
+
+    // Directory id and leaf name; coalescable events always have a directory.
+    typedef std::pair<std::uint32_t, boost::string_ref> key_t;
+
+    struct key_hash
+    {
+        std::size_t operator()(const key_t &key) const
+        {
+            std::size_t seed = key.first;
+            boost::hash_combine(seed, boost::hash_range(key.second.begin(), key.second.end()));
+            return seed;
+        }
+    };
+
+    static key_t key_of(const compact_dir_monitor_event &ev)
+    {
+        return key_t(ev.directory() ? ev.directory()->id : 0, boost::string_ref(ev.name(), ev.name_size()));
+    }
+
+    template <typename Sink>
+    void release(const key_t &key, Sink sink)
+    {
+        index_t::iterator it = index_.find(key);
+        if (it != index_.end())
+        {
+            sink(it->second->event);
+            pending_.erase(it->second);
+            index_.erase(it);
+        }
+    }
+
+    struct pending_event
+    {
+        compact_dir_monitor_event event;
+        clock::time_point deadline;
+        clock::time_point release_by;
+    };
+
+    typedef std::list<pending_event> pending_t;
+    typedef std::unordered_map<key_t, pending_t::iterator, key_hash> index_t;
+
+    /**
+     * Moves it, whose deadline was just set, behind the last event due no
+     * later, keeping pending_ sorted by deadline. A deadline of now plus
+     * the quiet window is the latest so far and goes to the back straight
+     * away; only one capped by release_by walks back any further.
+     */
+    void requeue(pending_t::iterator it)
+    {
+        pending_t::iterator position = pending_.end();
+        while (position != pending_.begin())
+        {
+            pending_t::iterator previous = std::prev(position);
+            if (previous == it || previous->deadline <= it->deadline)
+                break;
+            position = previous;
+        }
+        if (position != it && position != std::next(it))
+            pending_.splice(position, pending_, it);
+    }
+
+    std::chrono::milliseconds quiet_window_;
+    bool collapse_added_modified_;
+    pending_t pending_;
+    index_t index_;
+};
+
+}
+}
@@ -16,6 +16,8 @@
 #include <boost/unordered_set.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
 #include <string>
 #include <deque>
 #include <boost/thread.hpp>
@@ -92,7 +94,64 @@ public:
         }
     }
 
+    /**
+     * Takes the oldest event if there is one, without waiting.
+     */
+    boost::optional<dir_monitor_event> try_popfront_event(boost::system::error_code &ec)
+    {
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        return take_event(ec);
+    }
+
+    /**
+     * popfront_event() that gives up, returning nothing, after timeout.
+     */
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> popfront_event_for(const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        const boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now()
+            + boost::chrono::nanoseconds(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count());
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        while (run_ && events_.empty())
+        {
+            if (events_cond_.wait_until(lock, deadline) == boost::cv_status::timeout)
+                break;
+        }
+        return take_event(ec);
+    }
+
+    /**
+     * Moves up to max_events queued events to out under one lock; returns
+     * out past the last one.
+     */
+    template <typename OutputIterator>
+    OutputIterator drain_events(OutputIterator out, std::size_t max_events)
+    {
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        for (; max_events != 0 && !events_.empty(); --max_events)
+        {
+            *out++ = events_.front();
+            events_.pop_front();
+        }
+        return out;
+    }
+
 private:
+    // Called with events_mutex_ held; events left at destroy() are still handed out.
+    boost::optional<dir_monitor_event> take_event(boost::system::error_code &ec)
+    {
+        ec = boost::system::error_code();
+        if (events_.empty())
+        {
+            if (!run_)
+                ec = boost::asio::error::operation_aborted;
+            return boost::none;
+        }
+        dir_monitor_event ev = events_.front();
+        events_.pop_front();
+        return ev;
+    }
+
     CFArrayRef make_array(boost::unordered_set<std::string> in)
     {
         CFMutableArrayRef arr = CFArrayCreateMutable(kCFAllocatorDefault, in.size(), &kCFTypeArrayCallBacks);
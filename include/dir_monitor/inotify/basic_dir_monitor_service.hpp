@@ -7,22 +7,49 @@
 #pragma once
 
 #include "dir_monitor_impl.hpp"
+#include "recycling_allocator.hpp"
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 
+#include <iostream>
 #include <memory>
+#include <new>
 #include <string>
 #include <stdexcept>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <utility>
+#include <iterator>
+#include <vector>
 
 namespace boost {
 namespace asio {
 
-template <typename DirMonitorImplementation = dir_monitor_impl>
+/**
+ * How the monitors of one service run inotify.
+ */
+enum inotify_mode
+{
+    /** Every monitor has an inotify instance and threads of its own. */
+    inotify_per_monitor,
+    /**
+     * All monitors share one inotify instance, read by one thread; records
+     * are routed to the monitors watching their directory. The read buffer
+     * and read statistics are shared as well.
+     */
+    inotify_per_service,
+    /**
+     * Every monitor has an inotify instance read on the io_service it was
+     * created with, and no threads are started: records are parsed and
+     * events delivered by the threads running that io_service, any number
+     * of them: the work of each monitor runs on strands of its own. As
+     * with a socket, the blocking calls must not be made on those threads,
+     * and run() does not return while the monitor exists.
+     */
+    inotify_inline
+};
+
+template <typename DirMonitorImplementation = dir_monitor_impl, inotify_mode Mode = inotify_per_monitor>
 class basic_dir_monitor_service
     : public boost::asio::io_service::service
 {
@@ -30,35 +57,102 @@ public:
     static boost::asio::io_service::id id;
 
     explicit basic_dir_monitor_service(boost::asio::io_service &io_service)
-        : boost::asio::io_service::service(io_service),
-        async_monitor_work_(new boost::asio::io_service::work(async_monitor_io_service_)),
-        async_monitor_thread_(boost::bind(&boost::asio::io_service::run, &async_monitor_io_service_))
+        : boost::asio::io_service::service(io_service)
     {
+        if (Mode == inotify_per_service)
+        {
+            reader_ = std::make_shared<reader_type>(true);
+            reader_->start();
+        }
     }
 
     typedef std::shared_ptr<DirMonitorImplementation> implementation_type;
+    typedef typename DirMonitorImplementation::operation_ptr operation_ptr;
 
     void construct(implementation_type &impl)
     {
-        impl.reset(new DirMonitorImplementation());
-        impl->begin_read();
+        if (Mode == inotify_inline)
+            impl.reset(new DirMonitorImplementation(std::make_shared<reader_type>(false, &owner_io_service())));
+        else
+            impl.reset(new DirMonitorImplementation(reader_));
+        impl->start();
     }
 
     void destroy(implementation_type &impl)
     {
-        // If an asynchronous call is currently waiting for an event
-        // we must interrupt the blocked call to make sure it returns.
+        // Pending asynchronous calls complete with operation_aborted and
+        // blocked monitor() calls return.
         impl->destroy();
 
         impl.reset();
     }
 
-    void add_directory(implementation_type &impl, const std::string &dirname)
+    void add_directory(implementation_type &impl, const std::string &dirname, const dir_monitor_options &options = dir_monitor_options())
     {
         if (!boost::filesystem::is_directory(dirname))
             throw std::invalid_argument("boost::asio::basic_dir_monitor_service::add_directory: " + dirname + " is not a valid directory entry");
 
-        impl->add_directory(dirname);
+        impl->add_directory(dirname, options);
+    }
+
+    template <typename ProgressHandler, typename Handler>
+    class add_directory_operation
+    {
+    public:
+        add_directory_operation(implementation_type &impl, boost::asio::io_service &io_service, const std::string &dirname,
+            const dir_monitor_options &options, ProgressHandler progress, Handler handler)
+            : impl_(impl),
+            io_service_(io_service),
+            work_(io_service),
+            dirname_(dirname),
+            // Resolved on the caller's thread, against its working directory.
+            location_(boost::filesystem::absolute(dirname).string()),
+            options_(options),
+            progress_(progress),
+            handler_(handler)
+        {
+        }
+
+        void operator()() const
+        {
+            implementation_type impl = impl_.lock();
+            boost::system::error_code ec = boost::asio::error::operation_aborted;
+            std::size_t count = 0;
+            if (impl)
+            {
+                boost::asio::io_service &io_service = io_service_;
+                const ProgressHandler &progress = progress_;
+                count = impl->watch_tree(dirname_, options_, [&](std::size_t n)
+                {
+                    io_service.post(boost::asio::detail::bind_handler(progress, n));
+                }, ec, false, location_);
+            }
+            this->io_service_.post(boost::asio::detail::bind_handler(handler_, ec, count));
+        }
+
+    private:
+        std::weak_ptr<DirMonitorImplementation> impl_;
+        boost::asio::io_service &io_service_;
+        boost::asio::io_service::work work_;
+        std::string dirname_;
+        std::string location_;
+        dir_monitor_options options_;
+        ProgressHandler progress_;
+        Handler handler_;
+    };
+
+    template <typename ProgressHandler, typename Handler>
+    void async_add_directory(implementation_type &impl, const std::string &dirname, const dir_monitor_options &options,
+        ProgressHandler progress, Handler handler)
+    {
+        if (!boost::filesystem::is_directory(dirname))
+        {
+            boost::system::error_code ec = boost::system::errc::make_error_code(boost::system::errc::not_a_directory);
+            owner_io_service().post(boost::asio::detail::bind_handler(handler, ec, std::size_t(0)));
+            return;
+        }
+
+        boost::asio::post(impl->registration_strand(), add_directory_operation<ProgressHandler, Handler>(impl, owner_io_service(), dirname, options, progress, handler));
     }
 
     void remove_directory(implementation_type &impl, const std::string &dirname)
@@ -66,97 +160,346 @@ public:
         impl->remove_directory(dirname);
     }
 
+    std::vector<std::string> watched_directories(implementation_type &impl, const std::string &dirname)
+    {
+        return impl->watched_directories(dirname);
+    }
+
+    void cancel(implementation_type &impl)
+    {
+        impl->cancel();
+    }
+
+    void set_read_buffer_size(implementation_type &impl, std::size_t initial_size, std::size_t max_size)
+    {
+        impl->set_read_buffer_size(initial_size, max_size);
+    }
+
+    void set_rename_pairing(implementation_type &impl, std::chrono::milliseconds timeout)
+    {
+        impl->set_rename_pairing(timeout);
+    }
+
+    void set_queue_limit(implementation_type &impl, std::size_t capacity, dir_monitor_queue_policy policy)
+    {
+        impl->set_queue_limit(capacity, policy);
+    }
+
+    template <typename Handler>
+    void set_high_watermark(implementation_type &impl, std::size_t events, Handler handler)
+    {
+        boost::asio::io_service &io_service = owner_io_service();
+        impl->set_high_watermark(events, [&io_service, handler](std::size_t queued)
+        {
+            io_service.post(boost::asio::detail::bind_handler(handler, queued));
+        });
+    }
+
+    void set_inotify_instances(implementation_type &impl, std::size_t count)
+    {
+        // Shared and inline readers have no threads of their own to multiply.
+        if (Mode == inotify_per_monitor)
+            impl->set_inotify_instances(count);
+    }
+
+    void set_starvation_limit(implementation_type &impl, std::size_t limit)
+    {
+        impl->set_starvation_limit(limit);
+    }
+
+    void set_coalescing(implementation_type &impl, std::chrono::milliseconds quiet_window, bool collapse_added_modified)
+    {
+        impl->set_coalescing(quiet_window, collapse_added_modified);
+    }
+
+    void set_dispatch_strands(implementation_type &impl, std::size_t strands, bool by_directory)
+    {
+        impl->set_dispatch_strands(owner_io_service(), strands, by_directory);
+    }
+
+    dir_monitor_read_statistics read_statistics(implementation_type &impl)
+    {
+        return impl->read_statistics();
+    }
+
     dir_monitor_event monitor(implementation_type &impl, boost::system::error_code &ec)
     {
         return impl->popfront_event(ec);
     }
 
-    template <typename Handler>
+    compact_dir_monitor_event monitor_compact(implementation_type &impl, boost::system::error_code &ec)
+    {
+        return impl->template popfront_event<compact_dir_monitor_event>(ec);
+    }
+
+    boost::optional<dir_monitor_event> try_monitor(implementation_type &impl, boost::system::error_code &ec)
+    {
+        return impl->try_popfront_event(ec);
+    }
+
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> monitor_for(implementation_type &impl, const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        return impl->popfront_event_for(timeout, ec);
+    }
+
+    template <typename OutputIterator>
+    OutputIterator drain(implementation_type &impl, OutputIterator out, std::size_t max_events)
+    {
+        return impl->drain_events(out, max_events);
+    }
+
+    /**
+     * Waits in the implementation, without a thread, until it has events
+     * and then posts the handler with the first of them, or with up to
+     * max_events of them when Result is a vector.
+     *
+     * The handler is only ever moved, so it may be move-only. The operation
+     * and the posted completion are allocated with the handler's associated
+     * allocator, by default a recycling_allocator, so a handler that starts
+     * the next call settles on memory that is reused from event to event.
+     *
+     * With Boost 1.77 or later, a handler with an associated cancellation
+     * slot can have its call completed with operation_aborted on its own,
+     * as cancel() does for every pending call.
+     */
+    template <typename Handler, typename Result = dir_monitor_event>
     class monitor_operation
+        : public DirMonitorImplementation::operation
     {
     public:
-        monitor_operation(implementation_type &impl, boost::asio::io_service &io_service, Handler handler)
-            : impl_(impl),
-            io_service_(io_service),
-            work_(io_service),
-            handler_(handler)
+        typedef typename boost::asio::associated_allocator<Handler, recycling_allocator<void> >::type allocator_type;
+
+        static operation_ptr create(const implementation_type &impl, boost::asio::io_service &io_service, Handler &&handler)
         {
+            allocator_type allocator = boost::asio::get_associated_allocator(handler, recycling_allocator<void>());
+#if BOOST_VERSION >= 107700
+            typename boost::asio::associated_cancellation_slot<Handler>::type slot = boost::asio::get_associated_cancellation_slot(handler);
+#endif
+            operation_allocator alloc(allocator);
+            monitor_operation *op = alloc.allocate(1);
+            try
+            {
+                new (op) monitor_operation(io_service, std::move(handler), allocator);
+            }
+            catch (...)
+            {
+                alloc.deallocate(op, 1);
+                throw;
+            }
+#if BOOST_VERSION >= 107700
+            if (slot.is_connected())
+            {
+                op->set_cancellation_handle(&slot.template emplace<cancellation_handler>(impl).op_);
+                op->cancellable_ = true;
+            }
+#else
+            (void)impl;
+#endif
+            return operation_ptr(op);
         }
 
-        void operator()() const
+        virtual void complete(const boost::system::error_code &ec, std::vector<compact_dir_monitor_event> &events,
+            boost::asio::io_service::strand *strand) override
         {
-            implementation_type impl = impl_.lock();
-            boost::system::error_code ec = boost::asio::error::operation_aborted;
-            dir_monitor_event ev = impl ? impl->popfront_event(ec) : dir_monitor_event();
-#ifdef BOOST_OS_LINUX
-                // On Linux, avoid PostAndWait due to potential deadlock
-                this->io_service_.post(boost::asio::detail::bind_handler(handler_, ec, ev));
-#else
-                PostAndWait(ec, ev);
+            completion c(std::move(handler_), ec, allocator_, executor_);
+#if BOOST_VERSION >= 107700
+            c.cancellable_ = cancellable_;
 #endif
+            take_events(events, c.result_);
+            if (strand)
+                boost::asio::post(*strand, std::move(c));
+            else
+                boost::asio::post(io_service_, std::move(c));
         }
 
     protected:
-#ifndef BOOST_OS_LINUX
-        void PostAndWait(const boost::system::error_code ec, const dir_monitor_event& ev) const
+        virtual void destroy() override
         {
-            std::mutex post_mutex;
-            std::condition_variable post_condition_variable;
-            bool post_cancel = false;
+            operation_allocator alloc(allocator_);
+            this->~monitor_operation();
+            alloc.deallocate(this, 1);
+        }
 
-            this->io_service_.post(
-                [&]
-                {
-                    handler_(ec, ev);
-                    std::lock_guard<std::mutex> lock(post_mutex);
-                    post_cancel = true;
-                    post_condition_variable.notify_one();
-                }
-            );
-            std::unique_lock<std::mutex> lock(post_mutex);
-            while (!post_cancel)
-                post_condition_variable.wait(lock);
+    private:
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<monitor_operation> operation_allocator;
+
+        typedef typename boost::asio::associated_executor<Handler, boost::asio::io_service::executor_type>::type executor_type;
+
+        monitor_operation(boost::asio::io_service &io_service, Handler &&handler, const allocator_type &allocator)
+            : io_service_(io_service),
+            work_(io_service),
+            executor_(boost::asio::get_associated_executor(handler, io_service.get_executor())),
+            handler_(std::move(handler)),
+            allocator_(allocator)
+#if BOOST_VERSION >= 107700
+            , cancellable_(false)
+#endif
+        {
         }
+
+#if BOOST_VERSION >= 107700
+        // Lives in the handler's cancellation slot until the handler runs;
+        // op_ is reset by the implementation once the call has completed.
+        struct cancellation_handler
+        {
+            explicit cancellation_handler(const implementation_type &impl)
+                : impl_(impl),
+                op_(nullptr)
+            {
+            }
+
+            void operator()(boost::asio::cancellation_type_t type)
+            {
+                if (type == boost::asio::cancellation_type::none)
+                    return;
+                if (implementation_type impl = impl_.lock())
+                    impl->cancel_operation(&op_);
+            }
+
+            std::weak_ptr<DirMonitorImplementation> impl_;
+            typename DirMonitorImplementation::operation *op_;
+        };
 #endif
 
-    private:
-        std::weak_ptr<DirMonitorImplementation> impl_;
+        // Hands the result to the handler without copying either. Posted to
+        // the io_service (or strand), it is run on the handler's executor,
+        // which is the io_service unless the handler is bound elsewhere,
+        // e.g. to the executor of the coroutine awaiting it.
+        struct completion
+        {
+            typedef typename monitor_operation::allocator_type allocator_type;
+            typedef typename monitor_operation::executor_type executor_type;
+
+            completion(Handler &&handler, const boost::system::error_code &ec, const allocator_type &allocator,
+                const executor_type &executor)
+                : handler_(std::move(handler)),
+                ec_(ec),
+                allocator_(allocator),
+                executor_(executor)
+#if BOOST_VERSION >= 107700
+                , cancellable_(false)
+#endif
+            {
+            }
+
+            allocator_type get_allocator() const noexcept
+            {
+                return allocator_;
+            }
+
+            executor_type get_executor() const noexcept
+            {
+                return executor_;
+            }
+
+            void operator()()
+            {
+#if BOOST_VERSION >= 107700
+                if (cancellable_)
+                    boost::asio::get_associated_cancellation_slot(handler_).clear();
+#endif
+                handler_(ec_, std::move(result_));
+            }
+
+            // Keeps handlers wrapped by a strand running on it.
+            template <typename Function>
+            friend void asio_handler_invoke(Function &function, completion *this_handler)
+            {
+                boost_asio_handler_invoke_helpers::invoke(function, this_handler->handler_);
+            }
+
+            template <typename Function>
+            friend void asio_handler_invoke(const Function &function, completion *this_handler)
+            {
+                boost_asio_handler_invoke_helpers::invoke(function, this_handler->handler_);
+            }
+
+            Handler handler_;
+            boost::system::error_code ec_;
+            Result result_;
+            allocator_type allocator_;
+            executor_type executor_;
+#if BOOST_VERSION >= 107700
+            bool cancellable_;
+#endif
+        };
+
+        template <typename Event>
+        static void take_events(std::vector<compact_dir_monitor_event> &events, Event &ev)
+        {
+            if (!events.empty())
+                ev = Event(std::move(events.front()));
+        }
+
+        static void take_events(std::vector<compact_dir_monitor_event> &events, std::vector<dir_monitor_event> &batch)
+        {
+            batch.assign(std::make_move_iterator(events.begin()), std::make_move_iterator(events.end()));
+        }
+
         boost::asio::io_service &io_service_;
         boost::asio::io_service::work work_;
+        executor_type executor_;
         Handler handler_;
+        allocator_type allocator_;
+#if BOOST_VERSION >= 107700
+        bool cancellable_;
+#endif
     };
 
     template <typename Handler>
     void async_monitor(implementation_type &impl, Handler handler)
     {
-        this->async_monitor_io_service_.post(monitor_operation<Handler>(impl, this->get_io_service(), handler));
+        impl->async_popfront_events(1, monitor_operation<Handler>::create(impl, owner_io_service(), std::move(handler)));
+    }
+
+    template <typename Handler>
+    void async_monitor_compact(implementation_type &impl, Handler handler)
+    {
+        impl->async_popfront_events(1, monitor_operation<Handler, compact_dir_monitor_event>::create(impl, owner_io_service(), std::move(handler)));
+    }
+
+    std::vector<dir_monitor_event> monitor_batch(implementation_type &impl, std::size_t max_events, boost::system::error_code &ec)
+    {
+        return impl->popfront_events(max_events, ec);
+    }
+
+    std::vector<compact_dir_monitor_event> monitor_batch_compact(implementation_type &impl, std::size_t max_events, boost::system::error_code &ec)
+    {
+        return impl->template popfront_events<compact_dir_monitor_event>(max_events, ec);
+    }
+
+    template <typename Handler>
+    void async_monitor_batch(implementation_type &impl, std::size_t max_events, Handler handler)
+    {
+        impl->async_popfront_events(max_events,
+            monitor_operation<Handler, std::vector<dir_monitor_event> >::create(impl, owner_io_service(), std::move(handler)));
     }
 
 private:
-    virtual void shutdown_service() override
+    boost::asio::io_service &owner_io_service()
     {
-        // The async_monitor thread will finish when async_monitor_work_ is reset as all asynchronous
-        // operations have been aborted and were discarded before (in destroy).
-        async_monitor_work_.reset();
+        return this->get_io_context();
+    }
 
-        // Event processing is stopped to discard queued operations.
-        async_monitor_io_service_.stop();
+    virtual void shutdown_service() override
+    {
+        // Pending asynchronous operations were aborted in destroy; only a
+        // shared reader is left to stop.
+        if (reader_)
+            reader_->stop();
 
-        // The async_monitor thread is joined to make sure the directory monitor service is
-        // destroyed _after_ the thread is finished (not that the thread tries to access
-        // instance properties which don't exist anymore).
-        async_monitor_thread_.join();
-        
         std::cout << "shutdown complete" << std::endl;
     }
 
-    boost::asio::io_service async_monitor_io_service_;
-    std::unique_ptr<boost::asio::io_service::work> async_monitor_work_;
-    std::thread async_monitor_thread_;
+    typedef typename DirMonitorImplementation::reader_type reader_type;
+
+    // The reader shared by all monitors, with inotify_per_service.
+    std::shared_ptr<reader_type> reader_;
 };
 
-template <typename DirMonitorImplementation>
-boost::asio::io_service::id basic_dir_monitor_service<DirMonitorImplementation>::id;
+template <typename DirMonitorImplementation, inotify_mode Mode>
+boost::asio::io_service::id basic_dir_monitor_service<DirMonitorImplementation, Mode>::id;
 
 }
 }
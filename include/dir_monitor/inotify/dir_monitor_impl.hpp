@@ -6,204 +6,1733 @@
 //
 #pragma once
 
+#include "event_queue.hpp"
+#include "inotify_reader.hpp"
+#include "watch_table.hpp"
+#include "../event_coalescer.hpp"
+#include "../polling/dir_monitor_impl.hpp"
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
-#include <boost/bimap.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/optional.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
+#include <boost/utility/string_ref.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 namespace boost {
 namespace asio {
 
 class dir_monitor_impl
+    : public std::enable_shared_from_this<dir_monitor_impl>
 {
+    /**
+     * What is known about a directory entry, used to find out what changed
+     * while events were lost.
+     */
+    struct listing_entry
+    {
+        bool directory;
+        std::int64_t mtime_sec;
+        std::int64_t mtime_nsec;
+        std::int64_t size;
+    };
+
+    typedef std::unordered_map<std::string, listing_entry> listing_t;
+
+    struct pending_rename
+    {
+        compact_dir_monitor_event source;
+        uint32_t cookie;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // Directory id and leaf name of a rename source.
+    typedef std::pair<std::uint32_t, boost::string_ref> rename_key_t;
+
+    struct rename_key_hash
+    {
+        std::size_t operator()(const rename_key_t &key) const
+        {
+            std::size_t seed = key.first;
+            boost::hash_combine(seed, boost::hash_range(key.second.begin(), key.second.end()));
+            return seed;
+        }
+    };
+
+    typedef std::list<pending_rename> pending_renames_t;
+    typedef std::unordered_map<uint32_t, pending_renames_t::iterator> rename_cookies_t;
+    typedef std::unordered_map<rename_key_t, pending_renames_t::iterator, rename_key_hash> rename_paths_t;
+
+    struct watch_state
+    {
+        // Shared with every event reported for the directory.
+        compact_dir_monitor_event::directory_ptr directory;
+        // The path made absolute when the tree was added, for the system
+        // calls made on other threads, whose working directory may differ.
+        std::string location;
+        // Only changed by the inotify thread once the state is published.
+        listing_t listing;
+        // dir_monitor_options::event_class bits reported for this directory.
+        unsigned events;
+        // The state is published as soon as the watch is installed; the
+        // listing is merged in by the inotify thread once the directory is
+        // scanned. Until then, and while resyncs are pending, names seen in
+        // events are kept in touched.
+        bool scanned;
+        unsigned resyncs;
+        std::unordered_set<std::string> touched;
+    };
+
 public:
-    dir_monitor_impl()
-        : fd_(init_fd()),
-        run_(true),
-        inotify_work_(new boost::asio::io_service::work(inotify_io_service_)),
-        inotify_work_thread_(boost::bind(&boost::asio::io_service::run, &inotify_io_service_)),
-        stream_descriptor_(new boost::asio::posix::stream_descriptor(inotify_io_service_, fd_))
+    typedef inotify_reader<dir_monitor_impl> reader_type;
+
+    /**
+     * Events queued without locking or allocating; more spill into a list.
+     */
+    static const std::size_t event_capacity = 256;
+
+    /**
+     * An asynchronous monitor call waiting for events.
+     */
+    class operation
     {
+    public:
+        struct deleter
+        {
+            void operator()(operation *op) const { op->destroy(); }
+        };
+
+        /**
+         * Hands events (empty if ec is set) to the handler, through strand
+         * unless it is null. Called with the operations locked, from
+         * whichever thread completes the call, so this must only post the
+         * handler. Events may be moved from.
+         */
+        virtual void complete(const boost::system::error_code &ec, std::vector<compact_dir_monitor_event> &events,
+            boost::asio::io_service::strand *strand) = 0;
+
+    protected:
+        operation()
+            : max_events_(0),
+            previous_(nullptr),
+            next_(nullptr),
+            handle_(nullptr)
+        {
+        }
+
+        ~operation() { }
+
+        /**
+         * Destroys the operation and frees its memory with the allocator it
+         * came from.
+         */
+        virtual void destroy() = 0;
+
+        /**
+         * Makes *handle point to the operation while it is pending, for
+         * cancel_operation(handle); it is reset when the operation completes.
+         */
+        void set_cancellation_handle(operation **handle)
+        {
+            handle_ = handle;
+            *handle = this;
+        }
+
+    private:
+        friend class dir_monitor_impl;
+
+        // Pending operations form an intrusive list, so that any of them can
+        // be taken out in constant time.
+        std::size_t max_events_;
+        operation *previous_;
+        operation *next_;
+        operation **handle_;
+    };
+
+    typedef std::unique_ptr<operation, operation::deleter> operation_ptr;
+
+    /**
+     * Without a reader the monitor gets an inotify instance and threads of
+     * its own; otherwise it is read by reader, possibly along with others.
+     */
+    explicit dir_monitor_impl(const std::shared_ptr<reader_type> &reader = std::shared_ptr<reader_type>())
+        : reader_(reader ? reader : std::make_shared<reader_type>(false)),
+        registration_stopped_(false),
+        rename_timer_(reader_->io_service()),
+        rename_timer_armed_(false),
+        rename_timeout_(0),
+        coalesce_timer_(reader_->io_service()),
+        coalesce_timer_armed_(false),
+        events_(event_capacity, priority_high + 1),
+        queue_capacity_(0),
+        queue_policy_(queue_drop_oldest),
+        overflowing_(false),
+        flush_scheduled_(false),
+        paused_(false),
+        high_watermark_(0),
+        above_high_watermark_(false),
+        first_operation_(nullptr),
+        last_operation_(nullptr),
+        waiting_operations_(0),
+        shard_by_directory_(false),
+        merge_into_(nullptr),
+        merging_(false),
+        instance_index_(0),
+        instance_count_(1),
+        next_polled_id_(UINT32_MAX)
+    {
+        held_events_.configure(std::chrono::milliseconds(1), true);
     }
 
-    void add_directory(const std::string &dirname)
+    /**
+     * Attaches the monitor to its reader, starting a dedicated one.
+     */
+    void start()
     {
-        int wd = inotify_add_watch(fd_, dirname.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO);
-        if (wd == -1)
+        reader_->attach(shared_from_this());
+        if (!reader_->shared())
+            reader_->start();
+    }
+
+    /**
+     * On a shared reader this sets the buffer for every monitor on it.
+     */
+    void set_read_buffer_size(std::size_t initial_size, std::size_t max_size)
+    {
+        reader_->set_read_buffer_size(initial_size, max_size);
+        for (const auto &instance : instances_)
+            instance->set_read_buffer_size(initial_size, max_size);
+    }
+
+    /**
+     * With a non-zero timeout IN_MOVED_FROM/IN_MOVED_TO pairs sharing a cookie
+     * are reported as one renamed event, however many records of other
+     * files come between them. A source without a destination within
+     * timeout is reported as removed, and so is one whose path sees another
+     * event first, so that it does not trail it; a destination without a
+     * source is reported as added.
+     */
+    void set_rename_pairing(std::chrono::milliseconds timeout)
+    {
+        rename_timeout_ = timeout.count();
+        for (const auto &instance : instances_)
+            instance->set_rename_pairing(timeout);
+    }
+
+    /**
+     * Merges repeated events on a path until it has been quiet for
+     * quiet_window; see dir_monitor_event_coalescer. A zero window (the
+     * default) delivers every event as it is read.
+     */
+    void set_coalescing(std::chrono::milliseconds quiet_window, bool collapse_added_modified)
+    {
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self, quiet_window, collapse_added_modified]
+        {
+            std::shared_ptr<dir_monitor_impl> impl = self.lock();
+            if (!impl)
+                return;
+            impl->coalescer_.configure(quiet_window, collapse_added_modified);
+            if (!impl->coalescer_.enabled())
+                impl->coalescer_.flush([&impl](const compact_dir_monitor_event &ev) { impl->pushback_event(ev); });
+        });
+        for (const auto &instance : instances_)
+            instance->set_coalescing(quiet_window, collapse_added_modified);
+    }
+
+    /**
+     * Spreads the watches over count inotify instances, each with its own
+     * reader, which all feed the queue of this monitor: a directory added
+     * by add_directory() goes to the instance already watching it or its
+     * parent, or else to the one with the fewest watches, and its
+     * subdirectories stay with it. Events of one directory keep their
+     * order; renames across instances are not paired. Must be called
+     * before any directory is added, and with a dedicated reader only.
+     */
+    void set_inotify_instances(std::size_t count)
+    {
+        if (!instances_.empty() || watches_.size() != 0 || reader_->shared())
         {
-            boost::system::system_error e(boost::system::error_code(errno, boost::system::get_system_category()), "boost::asio::dir_monitor_impl::add_directory: inotify_add_watch failed");
+            std::logic_error e("boost::asio::dir_monitor_impl::set_inotify_instances: must be called once, before any directory is added, on a dedicated reader");
             boost::throw_exception(e);
         }
 
-        std::unique_lock<std::mutex> lock(watch_descriptors_mutex_);
-        watch_descriptors_.insert(watch_descriptors_t::value_type(wd, dirname));
-        lock.unlock();
-        check_sub_directory(dirname, true);
+        for (std::size_t i = 1; i < count; ++i)
+        {
+            std::shared_ptr<dir_monitor_impl> instance = std::make_shared<dir_monitor_impl>();
+            instance->merge_into_ = this;
+            instance->instance_index_ = static_cast<std::uint32_t>(i);
+            instance->instance_count_ = static_cast<std::uint32_t>(count);
+            instance->rename_timeout_.store(rename_timeout_.load());
+            instance->start();
+            instances_.push_back(instance);
+        }
+        if (instances_.empty())
+            return;
+        instance_count_ = static_cast<std::uint32_t>(count);
+        merging_.store(true, std::memory_order_release);
+    }
+
+    /**
+     * Bounds the queue to capacity events, or lifts the bound with zero.
+     * Once it is full, policy decides what becomes of further events; held
+     * events are released, and a paused reader resumes, once consumers
+     * have emptied half of the queue.
+     */
+    void set_queue_limit(std::size_t capacity, dir_monitor_queue_policy policy)
+    {
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self, capacity, policy]
+        {
+            std::shared_ptr<dir_monitor_impl> impl = self.lock();
+            if (!impl)
+                return;
+            std::unique_lock<std::mutex> lock = impl->lock_merge();
+            impl->queue_policy_ = policy;
+            impl->queue_capacity_.store(capacity, std::memory_order_relaxed);
+            impl->release_held_events();
+        });
     }
 
-    void remove_directory(const std::string &dirname)
+    /**
+     * Calls callback(queued events) on the reader thread when the queue
+     * grows to events events, and again each time it does so after having
+     * been found below. Zero turns this off.
+     */
+    void set_high_watermark(std::size_t events, std::function<void(std::size_t)> callback)
     {
-        std::unique_lock<std::mutex> lock(watch_descriptors_mutex_);
-        watch_descriptors_t::right_map::iterator it = watch_descriptors_.right.find(dirname);
-        if (it != watch_descriptors_.right.end())
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self, events, callback]
         {
-            inotify_rm_watch(fd_, it->second);
-            watch_descriptors_.right.erase(it);
-            lock.unlock();
-            check_sub_directory(dirname, false);
+            std::shared_ptr<dir_monitor_impl> impl = self.lock();
+            if (!impl)
+                return;
+            std::unique_lock<std::mutex> lock = impl->lock_merge();
+            impl->high_watermark_ = events;
+            impl->high_watermark_callback_ = callback;
+            impl->above_high_watermark_ = false;
+        });
+    }
+
+    /**
+     * Lets events of a lower priority through after limit events of higher
+     * ones have been taken in a row while they waited. Zero, the default,
+     * serves priorities strictly in order.
+     */
+    void set_starvation_limit(std::size_t limit)
+    {
+        events_.set_starvation_limit(limit);
+    }
+
+    /**
+     * On a shared reader these count the reads for every monitor on it;
+     * with several inotify instances they add up the reads of all of them.
+     */
+    dir_monitor_read_statistics read_statistics() const
+    {
+        dir_monitor_read_statistics stats = reader_->read_statistics();
+        for (const auto &instance : instances_)
+        {
+            const dir_monitor_read_statistics other = instance->read_statistics();
+            for (std::size_t i = 0; i < stats.histogram.size(); ++i)
+                stats.histogram[i] += other.histogram[i];
+            stats.reads += other.reads;
+            stats.bytes += other.bytes;
+            stats.full_reads += other.full_reads;
+            stats.reactor_reads += other.reactor_reads;
+            stats.buffer_capacity = (std::max)(stats.buffer_capacity, other.buffer_capacity);
         }
+        return stats;
     }
 
-    void check_sub_directory(const std::string &dirname, bool add_sub_directory)
+    /**
+     * Watches dirname and its subdirectories for the changes selected in
+     * options. Adding a directory again replaces its options.
+     */
+    void add_directory(const std::string &dirname, const dir_monitor_options &options = dir_monitor_options())
     {
-        boost::filesystem::directory_iterator end;
-        for (boost::filesystem::directory_iterator iter(dirname); iter != end; ++iter) {
-            if (boost::filesystem::is_directory(*iter)) {
-                if (add_sub_directory) {
-                    try {
-                        add_directory((*iter).path().string());
-                    } catch (const std::exception&) {
-                        continue;
-                    }
-                } else {
-                    remove_directory((*iter).path().string());
-                }
+        boost::system::error_code ec;
+        watch_tree(dirname, options, [](std::size_t) {}, ec);
+        if (ec)
+        {
+            boost::system::system_error e(ec, "boost::asio::dir_monitor_impl::add_directory: inotify_add_watch failed");
+            boost::throw_exception(e);
+        }
+    }
+
+    /**
+     * Subdirectories are watched on their own strand; functions posted here
+     * run there, one at a time.
+     */
+    boost::asio::io_service::strand &registration_strand()
+    {
+        return reader_->registration_strand();
+    }
+
+    /**
+     * Directories reported to the progress callback of watch_tree() at a time.
+     */
+    static std::size_t progress_interval() { return 1024; }
+
+    /**
+     * Watches dirname and everything below it, calling progress(count) every
+     * progress_interval() directories. Returns the number of directories
+     * watched. ec is set if dirname itself cannot be watched, or to
+     * operation_aborted if the monitor is destroyed meanwhile; subdirectories
+     * that cannot be watched are skipped.
+     *
+     * With report_existing, entries found in the directories are reported as
+     * added, as for a directory that just appeared; see watch_directory().
+     *
+     * A relative dirname is resolved against the working directory of the
+     * moment unless location gives the absolute path already; events keep
+     * reporting paths as given.
+     */
+    template <typename Progress>
+    std::size_t watch_tree(const std::string &dirname, const dir_monitor_options &options, Progress progress, boost::system::error_code &ec,
+        bool report_existing = false, std::string location = std::string())
+    {
+        if (options.poll_interval.count() != 0)
+            return poll_tree(dirname, options, ec);
+
+        if (location.empty())
+            location = boost::filesystem::absolute(dirname).string();
+
+        if (merging_.load(std::memory_order_acquire))
+        {
+            dir_monitor_impl *instance = instance_for(dirname);
+            if (instance != this)
+                return instance->watch_tree(dirname, options, progress, ec, report_existing, location);
+        }
+
+        // Path as reported and absolute path of each directory still to watch.
+        std::vector<std::pair<std::string, std::string> > pending;
+        ec = boost::system::error_code();
+        if (!watch_directory(dirname, location, options, report_existing, pending, ec))
+            return 0;
+
+        std::size_t count = 1;
+        while (!pending.empty())
+        {
+            if (registration_stopped_)
+            {
+                ec = boost::asio::error::operation_aborted;
+                break;
             }
+
+            std::pair<std::string, std::string> sub_directory = std::move(pending.back());
+            pending.pop_back();
+            boost::system::error_code sub_ec;
+            if (watch_directory(sub_directory.first, sub_directory.second, options, report_existing, pending, sub_ec) && ++count % progress_interval() == 0)
+                progress(count);
         }
+        return count;
     }
 
+    /**
+     * Stops watching dirname and everything below it. Uses the watch tree
+     * only, so it works for directories that are already gone.
+     */
+    void remove_directory(const std::string &dirname)
+    {
+        for (int wd : watches_.erase_tree(dirname))
+            reader_->remove_watch(this, wd);
+        for (const auto &instance : instances_)
+            instance->remove_directory(dirname);
+        std::lock_guard<std::mutex> lock(poller_mutex_);
+        if (!poller_)
+            return;
+        poller_->remove_directory(dirname);
+        // Behind whatever the poller posted for it before it was removed.
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self, dirname]
+        {
+            if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                impl->forget_polled(dirname);
+        });
+    }
+
+    /**
+     * dirname and every watched directory below it, parents first.
+     */
+    std::vector<std::string> watched_directories(const std::string &dirname) const
+    {
+        std::vector<std::string> directories;
+        for (const auto &watch : watches_.subtree(dirname))
+            directories.push_back(watch.second);
+        for (const auto &instance : instances_)
+        {
+            std::vector<std::string> more = instance->watched_directories(dirname);
+            directories.insert(directories.end(), more.begin(), more.end());
+        }
+        return directories;
+    }
+
+    ~dir_monitor_impl()
+    {
+        // Only left over if destroy() was never called.
+        while (first_operation_)
+            operation_ptr op(unlink(first_operation_));
+    }
+
+    /**
+     * A dedicated reader is stopped; a shared one keeps running for the
+     * other monitors, and drops the watches only this monitor held.
+     */
     void destroy()
     {
-        inotify_work_.reset();
-        inotify_io_service_.stop();
-        inotify_work_thread_.join();
-        stream_descriptor_.reset();
+        registration_stopped_ = true;
+        {
+            // Joined first, so that it posts nothing once the reader is gone.
+            std::lock_guard<std::mutex> lock(poller_mutex_);
+            if (poller_)
+                poller_->destroy();
+        }
+        if (reader_->shared())
+        {
+            reader_->detach(this);
+            if (paused_.exchange(false))
+            {
+                std::shared_ptr<reader_type> reader = reader_;
+                boost::asio::post(reader_->strand(), [reader] { reader->resume(); });
+            }
+        }
+        else
+            reader_->stop();
+        // Their readers are joined before the queue they feed is closed.
+        for (const auto &instance : instances_)
+            instance->destroy();
 
-        std::unique_lock<std::mutex> lock(events_mutex_);
-        run_ = false;
-        events_cond_.notify_all();
+        events_.close();
+        std::lock_guard<std::mutex> lock(operations_mutex_);
+        complete_operations();
     }
 
-    dir_monitor_event popfront_event(boost::system::error_code &ec)
+    /**
+     * Event is dir_monitor_event or compact_dir_monitor_event; events are
+     * queued in compact form and only converted here.
+     */
+    template <typename Event = dir_monitor_event>
+    Event popfront_event(boost::system::error_code &ec)
     {
-        std::unique_lock<std::mutex> lock(events_mutex_);
-        events_cond_.wait(lock, [&]() { return !(run_ && events_.empty()); });
-        
-        dir_monitor_event ev;
+        compact_dir_monitor_event ev;
         ec = boost::system::error_code();
-        if (!run_)
+        if (events_.pop(ev))
+            made_room();
+        else
             ec = boost::asio::error::operation_aborted;
-        else if (!events_.empty())
+        return Event(std::move(ev));
+    }
+
+    /**
+     * Waits for events like popfront_event() and takes up to max_events of
+     * them.
+     */
+    template <typename Event = dir_monitor_event>
+    std::vector<Event> popfront_events(std::size_t max_events, boost::system::error_code &ec)
+    {
+        std::vector<Event> events;
+        compact_dir_monitor_event ev;
+        ec = boost::system::error_code();
+        if (!events_.pop(ev))
         {
-            ev = events_.front();
-            events_.pop_front();
+            ec = boost::asio::error::operation_aborted;
+            return events;
         }
-            
-        return ev;
+        do
+            events.push_back(Event(std::move(ev)));
+        while (events.size() < max_events && events_.try_pop(ev));
+        made_room();
+        return events;
     }
 
-    void pushback_event(dir_monitor_event ev)
+    /**
+     * Takes the oldest event if there is one, without waiting. Once the
+     * monitor is destroyed ec is set to operation_aborted.
+     */
+    template <typename Event = dir_monitor_event>
+    boost::optional<Event> try_popfront_event(boost::system::error_code &ec)
     {
-        std::unique_lock<std::mutex> lock(events_mutex_);
-        if (run_)
+        compact_dir_monitor_event ev;
+        ec = boost::system::error_code();
+        if (events_.closed())
+            ec = boost::asio::error::operation_aborted;
+        else if (events_.try_pop(ev))
         {
-            events_.push_back(ev);
-            events_cond_.notify_all();
+            made_room();
+            return Event(std::move(ev));
         }
+        return boost::none;
     }
 
-private:
-    int init_fd()
+    /**
+     * popfront_event() that gives up, returning nothing, after timeout.
+     */
+    template <typename Event = dir_monitor_event, typename Rep, typename Period>
+    boost::optional<Event> popfront_event_for(const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
     {
-        int fd = inotify_init();
-        if (fd == -1)
+        compact_dir_monitor_event ev;
+        ec = boost::system::error_code();
+        if (events_.pop_until(ev, std::chrono::steady_clock::now() + timeout))
         {
-            boost::system::system_error e(boost::system::error_code(errno, boost::system::get_system_category()), "boost::asio::dir_monitor_impl::init_fd: init_inotify failed");
-            boost::throw_exception(e);
+            made_room();
+            return Event(std::move(ev));
         }
-        return fd;
+        if (events_.closed())
+            ec = boost::asio::error::operation_aborted;
+        return boost::none;
     }
 
-public:
-    void begin_read()
+    /**
+     * Moves up to max_events queued events to out without waiting; returns
+     * out past the last one.
+     */
+    template <typename Event = dir_monitor_event, typename OutputIterator>
+    OutputIterator drain_events(OutputIterator out, std::size_t max_events)
+    {
+        compact_dir_monitor_event ev;
+        std::size_t taken = 0;
+        while (taken < max_events && events_.try_pop(ev))
+        {
+            *out++ = Event(std::move(ev));
+            ++taken;
+        }
+        if (taken != 0)
+            made_room();
+        return out;
+    }
+
+    /**
+     * Completes asynchronous calls through count strands on io_service. An
+     * event goes to the strand picked by a hash of its path, or of its
+     * directory with by_directory, so handlers for one file (or directory)
+     * run in order while others run in parallel. A batch stops short at the
+     * first event for another strand. Zero strands turn this off.
+     */
+    void set_dispatch_strands(boost::asio::io_service &io_service, std::size_t count, bool by_directory)
     {
-        stream_descriptor_->async_read_some(boost::asio::buffer(read_buffer_),
-            boost::bind(&dir_monitor_impl::end_read, this,
-            boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        std::lock_guard<std::mutex> lock(operations_mutex_);
+        strands_.clear();
+        for (std::size_t i = 0; i < count; ++i)
+            strands_.emplace_back(new boost::asio::io_service::strand(io_service));
+        shard_by_directory_ = by_directory;
+    }
+
+    /**
+     * Completes op with up to max_events events once there are any, or with
+     * operation_aborted once it is cancelled or the monitor is destroyed.
+     * No thread waits meanwhile: op is kept until pushback_event(), cancel()
+     * or destroy() completes it. Operations complete in the order they
+     * were started.
+     */
+    void async_popfront_events(std::size_t max_events, operation_ptr op)
+    {
+        std::lock_guard<std::mutex> lock(operations_mutex_);
+        operation *o = op.release();
+        o->max_events_ = max_events;
+        o->previous_ = last_operation_;
+        if (last_operation_)
+            last_operation_->next_ = o;
+        else
+            first_operation_ = o;
+        last_operation_ = o;
+        waiting_operations_.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence in pushback_event().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        complete_operations();
+    }
+
+    /**
+     * Completes every pending operation with operation_aborted. Queued
+     * events stay queued for the next call, and the watches are kept.
+     */
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(operations_mutex_);
+        while (first_operation_)
+            abort(first_operation_);
+    }
+
+    /**
+     * Completes the operation *handle points to with operation_aborted, in
+     * constant time, unless it has completed already. See
+     * operation::set_cancellation_handle().
+     */
+    void cancel_operation(operation **handle)
+    {
+        std::lock_guard<std::mutex> lock(operations_mutex_);
+        if (*handle)
+            abort(*handle);
+    }
+
+    /**
+     * Only called by the reader, or the readers of the other instances
+     * holding the lock; see event_queue.
+     */
+    void pushback_event(compact_dir_monitor_event ev)
+    {
+        if (merge_into_)
+        {
+            merge_into_->pushback_event(std::move(ev));
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock = lock_merge();
+        const std::size_t capacity = queue_capacity_.load(std::memory_order_relaxed);
+        if (capacity != 0 && !admit(ev, capacity))
+            return;
+        enqueue(ev);
+        // Stops reading before the next record rather than queuing it past
+        // the limit; the records already read wait in the read buffer.
+        if (capacity != 0 && queue_policy_ == queue_backpressure && events_.size() >= capacity &&
+            !paused_.exchange(true))
+        {
+            pause_readers();
+            await_room(capacity);
+        }
+    }
+
+    /**
+     * Called by the reader once it has drained the descriptor.
+     */
+    void read_complete()
+    {
+        // Every event queued before a resync has been read by now.
+        resynced_.clear();
+        // No watch_state is held across reads.
+        watches_.reclaim();
+    }
+
+    /**
+     * Called by the reader for every record on a watch of this monitor, and
+     * for IN_Q_OVERFLOW.
+     */
+    void handle_event(const inotify_event &iev)
+    {
+        if (iev.mask & IN_Q_OVERFLOW)
+        {
+            // Their destinations may be among the records lost.
+            while (!pending_renames_.empty())
+                flush_rename(pending_renames_.begin());
+            resync();
+            return;
+        }
+
+        // Sent once a watch is gone, e.g. after remove_directory(); there is nothing to report.
+        if (iev.mask & IN_IGNORED)
+        {
+            watches_.erase(iev.wd);
+            return;
+        }
+
+        // The name field is only present when len is non-zero, and NUL-padded.
+        const char *name = iev.len ? iev.name : "";
+        const std::size_t name_size = iev.len ? ::strnlen(iev.name, iev.len) : 0;
+        dir_monitor_event::event_type type = dir_monitor_event::null;
+        switch (iev.mask & ~IN_ISDIR)
+        {
+        case IN_CREATE: type = dir_monitor_event::added; break;
+        case IN_DELETE: type = dir_monitor_event::removed; break;
+        case IN_MODIFY: type = dir_monitor_event::modified; break;
+        case IN_MOVED_FROM: type = dir_monitor_event::renamed_old_name; break;
+        case IN_MOVED_TO: type = dir_monitor_event::renamed_new_name; break;
+        case IN_CLOSE_WRITE: type = dir_monitor_event::modified; break;
+        case IN_ATTRIB: type = dir_monitor_event::metadata_changed; break;
+        }
+
+        watch_state *watch = watches_.find(iev.wd);
+        if (!watch)
+            return;
+        // The state stays put until reclaim() in read_complete(), even if
+        // its watch is erased meanwhile, so nothing is copied out of it.
+        const compact_dir_monitor_event::directory_ptr &directory = watch->directory;
+        // A source waiting for its destination goes out before anything
+        // else happening to its path.
+        if (!pending_renames_.empty() && !((iev.mask & IN_MOVED_TO) && rename_cookies_.count(iev.cookie)))
+        {
+            rename_paths_t::iterator pending = rename_paths_.find(rename_key_t(directory->id, boost::string_ref(name, name_size)));
+            if (pending != rename_paths_.end())
+                flush_rename(pending->second);
+        }
+        const std::string &location = watch->location;
+        const unsigned events = watch->events;
+        // A shared watch carries the masks of every monitor holding it.
+        if (reader_->shared() && !(iev.mask & inotify_mask(dir_monitor_options(events))))
+            return;
+        if (!update_listing(iev.wd, *watch, name, type))
+            return;
+
+        if (iev.mask == (IN_MOVED_FROM | IN_ISDIR))
+        {
+            // The watches below keep working under the new name, but with
+            // stale paths; the destination, if watched, is added afresh.
+            for (int wd : watches_.erase_tree(directory->path.native() + "/" + name))
+                reader_->remove_watch(this, wd);
+        }
+        if (iev.mask == (IN_CREATE | IN_ISDIR) || iev.mask == (IN_MOVED_TO | IN_ISDIR))
+            register_sub_directory(directory->path.native() + "/" + name, location + "/" + name, dir_monitor_options(events, directory->priority));
+        if (!subscribed(events, type))
+            return;
+        compact_dir_monitor_event ev(directory, name, name_size, type);
+        if (rename_timeout_ != 0 && type == dir_monitor_event::renamed_old_name)
+        {
+            begin_rename(iev.cookie, std::move(ev));
+            return;
+        }
+        if (rename_timeout_ != 0 && type == dir_monitor_event::renamed_new_name)
+        {
+            end_rename(iev.cookie, std::move(ev));
+            return;
+        }
+        emit(std::move(ev));
     }
 
 private:
-    void end_read(const boost::system::error_code &ec, std::size_t bytes_transferred)
+    // Overflows belong to no directory and go first.
+    static dir_monitor_priority lane_of(const compact_dir_monitor_event &ev)
     {
-        if (!ec)
+        return ev.directory() ? ev.directory()->priority : priority_high;
+    }
+
+    void enqueue(compact_dir_monitor_event &ev)
+    {
+        if (!events_.push(ev, lane_of(ev)))
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting_operations_.load(std::memory_order_relaxed) != 0)
+        {
+            std::lock_guard<std::mutex> lock(operations_mutex_);
+            complete_operations();
+        }
+
+        if (high_watermark_ != 0)
         {
-            pending_read_buffer_ += std::string(read_buffer_.data(), bytes_transferred);
-            while (pending_read_buffer_.size() > sizeof(inotify_event))
+            const std::size_t queued = events_.size();
+            if (queued < high_watermark_)
+                above_high_watermark_ = false;
+            else if (!above_high_watermark_)
             {
-                const inotify_event *iev = reinterpret_cast<const inotify_event*>(pending_read_buffer_.data());
-                dir_monitor_event::event_type type = dir_monitor_event::null;
-                switch (iev->mask)
+                above_high_watermark_ = true;
+                if (high_watermark_callback_)
+                    high_watermark_callback_(queued);
+            }
+        }
+    }
+
+    /**
+     * Applies the queue limit to ev. Returns false if ev was held back or
+     * merged instead, to be released by release_held_events().
+     */
+    bool admit(compact_dir_monitor_event &ev, std::size_t capacity)
+    {
+        if (holding_events() && events_.size() <= capacity / 2)
+            release_held_events();
+        if (!holding_events() && events_.size() < capacity)
+            return true;
+
+        switch (queue_policy_)
+        {
+        case queue_drop_oldest:
+        {
+            compact_dir_monitor_event oldest;
+            events_.try_pop_lowest(oldest);
+            return true;
+        }
+        case queue_coalesce_per_path:
+        {
+            const bool held = held_events_.push(ev, dir_monitor_event_coalescer::clock::now(),
+                [this](const compact_dir_monitor_event &released)
                 {
-                case IN_CREATE: type = dir_monitor_event::added; break;
-                case IN_DELETE: type = dir_monitor_event::removed; break;
-                case IN_MODIFY: type = dir_monitor_event::modified; break;
-                case IN_MOVED_FROM: type = dir_monitor_event::renamed_old_name; break;
-                case IN_MOVED_TO: type = dir_monitor_event::renamed_new_name; break;
-                case IN_CREATE | IN_ISDIR:
+                    compact_dir_monitor_event e(released);
+                    enqueue(e);
+                });
+            await_room(capacity);
+            // Renames are not held, only the events for their paths released.
+            return !held;
+        }
+        case queue_rescan_directory:
+            if (!ev.directory())
+                return true;
+            hold_rescan(ev.directory());
+            if (ev.old_directory())
+                hold_rescan(ev.old_directory());
+            await_room(capacity);
+            return false;
+        case queue_backpressure:
+            // Reading stops once the queue is full, so only events that are
+            // not records get here (expired renames, resyncs, ...), and the
+            // records other instances handed out before they paused.
+            if (!paused_.exchange(true))
+                pause_readers();
+            held_back_.push_back(ev);
+            await_room(capacity);
+            return false;
+        }
+        return true;
+    }
+
+    void hold_rescan(const compact_dir_monitor_event::directory_ptr &directory)
+    {
+        if (held_rescan_ids_.insert(directory->id).second)
+            held_rescans_.push_back(directory);
+    }
+
+    bool holding_events() const
+    {
+        return !held_back_.empty() || !held_events_.empty() || !held_rescans_.empty();
+    }
+
+    // Has the next consumer to make room call release_held_events(). Reader thread.
+    void await_room(std::size_t capacity)
+    {
+        overflowing_.store(true, std::memory_order_relaxed);
+        // Pairs with the fence in made_room(): consumers that emptied the
+        // queue before seeing overflowing_ are made up for here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (events_.size() <= capacity / 2)
+            schedule_release();
+    }
+
+    // Called by consumers after taking events.
+    void made_room()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!overflowing_.load(std::memory_order_relaxed))
+            return;
+        if (events_.size() <= queue_capacity_.load(std::memory_order_relaxed) / 2)
+            schedule_release();
+    }
+
+    void schedule_release()
+    {
+        if (flush_scheduled_.exchange(true))
+            return;
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self]
+        {
+            if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+            {
+                std::unique_lock<std::mutex> lock = impl->lock_merge();
+                impl->release_held_events();
+            }
+        });
+    }
+
+    // Queues what is held back as far as the queue has room, and resumes
+    // a paused reader once nothing is left. Reader thread.
+    void release_held_events()
+    {
+        flush_scheduled_.store(false);
+        overflowing_.store(false, std::memory_order_relaxed);
+        const std::size_t capacity = queue_capacity_.load(std::memory_order_relaxed);
+        std::size_t room = (std::numeric_limits<std::size_t>::max)();
+        if (capacity != 0)
+        {
+            const std::size_t queued = events_.size();
+            room = queued < capacity ? capacity - queued : 0;
+        }
+
+        std::size_t released = 0;
+        for (; released < held_back_.size() && released < room; ++released)
+            enqueue(held_back_[released]);
+        held_back_.erase(held_back_.begin(), held_back_.begin() + released);
+        room -= released;
+
+        room -= held_events_.flush([this](const compact_dir_monitor_event &released)
+        {
+            compact_dir_monitor_event e(released);
+            enqueue(e);
+        }, room);
+        std::size_t rescans = 0;
+        for (; rescans < held_rescans_.size() && rescans < room; ++rescans)
+        {
+            compact_dir_monitor_event ev(held_rescans_[rescans], "", 0, dir_monitor_event::recursive_rescan);
+            held_rescan_ids_.erase(held_rescans_[rescans]->id);
+            enqueue(ev);
+        }
+        held_rescans_.erase(held_rescans_.begin(), held_rescans_.begin() + rescans);
+
+        if (holding_events())
+        {
+            // The rest waits for consumers to make room again.
+            await_room(capacity);
+            return;
+        }
+        if (paused_.exchange(false))
+            resume_readers();
+    }
+
+    /**
+     * Serializes the queue side of the monitor (everything after the
+     * coalescing stage) once other instances feed it; a no-op before.
+     */
+    std::unique_lock<std::mutex> lock_merge()
+    {
+        std::unique_lock<std::mutex> lock(merge_mutex_, std::defer_lock);
+        if (merging_.load(std::memory_order_acquire))
+            lock.lock();
+        return lock;
+    }
+
+    // Called with the queue side locked, on any of the reader threads.
+    void pause_readers()
+    {
+        if (!merging_.load(std::memory_order_acquire))
+        {
+            reader_->pause();
+            return;
+        }
+        // Every reader pauses on its own thread, after the record in hand.
+        post_to_readers([](reader_type &reader) { reader.pause(); });
+    }
+
+    void resume_readers()
+    {
+        if (!merging_.load(std::memory_order_acquire))
+        {
+            reader_->resume();
+            return;
+        }
+        post_to_readers([](reader_type &reader) { reader.resume(); });
+    }
+
+    template <typename Function>
+    void post_to_readers(Function function)
+    {
+        std::vector<std::shared_ptr<reader_type> > readers(1, reader_);
+        for (const auto &instance : instances_)
+            readers.push_back(instance->reader_);
+        for (const auto &reader : readers)
+            boost::asio::post(reader->strand(), [reader, function] { function(*reader); });
+    }
+
+    /**
+     * The instance dirname belongs to: the one watching it or its parent,
+     * or else the one with the fewest watches.
+     */
+    dir_monitor_impl *instance_for(const std::string &dirname)
+    {
+        std::vector<dir_monitor_impl*> candidates(1, this);
+        for (const auto &instance : instances_)
+            candidates.push_back(instance.get());
+
+        const std::string::size_type slash = dirname.find_last_of('/');
+        const std::string parent = slash == std::string::npos ? std::string() : dirname.substr(0, slash);
+        for (dir_monitor_impl *candidate : candidates)
+        {
+            if (candidate->watches_.find(dirname) != -1 || (!parent.empty() && candidate->watches_.find(parent) != -1))
+                return candidate;
+        }
+
+        dir_monitor_impl *least = this;
+        std::size_t least_watches = watches_.size();
+        for (dir_monitor_impl *candidate : candidates)
+        {
+            const std::size_t watches = candidate->watches_.size();
+            if (watches < least_watches)
+            {
+                least = candidate;
+                least_watches = watches;
+            }
+        }
+        return least;
+    }
+
+    // Takes op out of the pending list. Called with operations_mutex_ held.
+    operation *unlink(operation *op)
+    {
+        if (op->previous_)
+            op->previous_->next_ = op->next_;
+        else
+            first_operation_ = op->next_;
+        if (op->next_)
+            op->next_->previous_ = op->previous_;
+        else
+            last_operation_ = op->previous_;
+        op->previous_ = op->next_ = nullptr;
+        if (op->handle_)
+            *op->handle_ = nullptr;
+        waiting_operations_.fetch_sub(1, std::memory_order_relaxed);
+        return op;
+    }
+
+    // Called with operations_mutex_ held.
+    void abort(operation *o)
+    {
+        operation_ptr op(unlink(o));
+        completed_events_.clear();
+        op->complete(boost::asio::error::operation_aborted, completed_events_, nullptr);
+    }
+
+    // Called with operations_mutex_ held.
+    void complete_operations()
+    {
+        while (first_operation_)
+        {
+            // Reused from one completion to the next.
+            std::vector<compact_dir_monitor_event> &events = completed_events_;
+            events.clear();
+            boost::system::error_code ec;
+            boost::asio::io_service::strand *strand = nullptr;
+            if (events_.closed())
+                ec = boost::asio::error::operation_aborted;
+            else
+            {
+                compact_dir_monitor_event ev;
+                const std::size_t max_events = first_operation_->max_events_;
+                std::size_t shard = 0;
+                while (events.size() < max_events && events_.try_pop(ev))
+                {
+                    if (!strands_.empty())
                     {
-                        type = dir_monitor_event::added;
-                        add_directory(get_dirname(iev->wd) + "/" + iev->name);
-                        break;
+                        const std::size_t ev_shard = shard_of(ev);
+                        if (events.empty())
+                            shard = ev_shard;
+                        else if (ev_shard != shard)
+                        {
+                            // Left for whoever takes events next, synchronous
+                            // calls included, ahead of everything still queued.
+                            events_.push_front(ev, lane_of(ev));
+                            break;
+                        }
                     }
+                    events.push_back(std::move(ev));
                 }
-                pushback_event(dir_monitor_event(boost::filesystem::path(get_dirname(iev->wd)) / iev->name, type));
-                pending_read_buffer_.erase(0, sizeof(inotify_event) + iev->len);
+                if (events.empty())
+                    break;
+                if (!strands_.empty())
+                    strand = strands_[shard].get();
             }
 
-            begin_read();
+            operation_ptr op(unlink(first_operation_));
+            op->complete(ec, events, strand);
+            if (!ec)
+                made_room();
         }
-        else if (ec != boost::asio::error::operation_aborted)
+    }
+
+    std::size_t shard_of(const compact_dir_monitor_event &ev) const
+    {
+        std::size_t seed = 0;
+        if (ev.directory())
+            boost::hash_combine(seed, ev.directory()->id);
+        if (!shard_by_directory_)
+            boost::hash_range(seed, ev.name(), ev.name() + ev.name_size());
+        return seed % strands_.size();
+    }
+
+    /**
+     * Hands an event from the reader to the coalescing stage, or straight to
+     * the queue if coalescing is off.
+     */
+    void emit(compact_dir_monitor_event ev)
+    {
+        auto sink = [this](const compact_dir_monitor_event &ev) { pushback_event(ev); };
+        if (!coalescer_.enabled())
         {
-            boost::system::system_error e(ec);
-            boost::throw_exception(e);
+            pushback_event(std::move(ev));
+            return;
+        }
+
+        dir_monitor_event_coalescer::clock::time_point now = dir_monitor_event_coalescer::clock::now();
+        if (!coalescer_.push(ev, now, sink))
+        {
+            pushback_event(std::move(ev));
+            return;
+        }
+
+        if (!coalesce_timer_armed_)
+        {
+            coalesce_timer_armed_ = true;
+            coalesce_timer_.expires_at(coalescer_.expire(now, sink));
+            async_wait(coalesce_timer_, &dir_monitor_impl::expire_coalesced);
+        }
+    }
+
+    void expire_coalesced(const boost::system::error_code &ec)
+    {
+        coalesce_timer_armed_ = false;
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+
+        dir_monitor_event_coalescer::clock::time_point next = coalescer_.expire(dir_monitor_event_coalescer::clock::now(),
+            [this](const compact_dir_monitor_event &ev) { pushback_event(ev); });
+        if (next != dir_monitor_event_coalescer::clock::time_point::max())
+        {
+            coalesce_timer_armed_ = true;
+            coalesce_timer_.expires_at(next);
+            async_wait(coalesce_timer_, &dir_monitor_impl::expire_coalesced);
+        }
+    }
+
+    /**
+     * Waits on timer without keeping the monitor alive; handler is skipped
+     * once the monitor is gone.
+     */
+    void async_wait(boost::asio::steady_timer &timer, void (dir_monitor_impl::*handler)(const boost::system::error_code&))
+    {
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        timer.async_wait(boost::asio::bind_executor(reader_->strand(), [self, handler](const boost::system::error_code &ec)
+        {
+            if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                (impl.get()->*handler)(ec);
+        }));
+    }
+
+    void begin_rename(uint32_t cookie, compact_dir_monitor_event source)
+    {
+        const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(rename_timeout_);
+        pending_rename rename = { std::move(source), cookie, deadline };
+        pending_renames_t::iterator it = pending_renames_.insert(pending_renames_.end(), std::move(rename));
+        rename_cookies_[cookie] = it;
+        // The key refers to the name held by the list node, which stays put.
+        rename_paths_[rename_key_of(it->source)] = it;
+
+        if (!rename_timer_armed_)
+        {
+            rename_timer_armed_ = true;
+            rename_timer_.expires_at(deadline);
+            async_wait(rename_timer_, &dir_monitor_impl::expire_renames);
+        }
+    }
+
+    void end_rename(uint32_t cookie, compact_dir_monitor_event destination)
+    {
+        rename_cookies_t::iterator it = rename_cookies_.find(cookie);
+        if (it == rename_cookies_.end())
+        {
+            // Moved in from outside the watched directories.
+            destination.type = dir_monitor_event::added;
+            emit(std::move(destination));
+            return;
+        }
+
+        const pending_renames_t::iterator rename = it->second;
+        const compact_dir_monitor_event &source = rename->source;
+        compact_dir_monitor_event ev(source.directory(), source.name(), source.name_size(),
+            destination.directory(), destination.name(), destination.name_size(), dir_monitor_event::renamed);
+        unindex_rename(rename);
+        pending_renames_.erase(rename);
+        emit(std::move(ev));
+    }
+
+    void expire_renames(const boost::system::error_code &ec)
+    {
+        rename_timer_armed_ = false;
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+
+        // Deadlines are in order unless the timeout was shortened meanwhile,
+        // which only holds the later ones back a little longer.
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while (!pending_renames_.empty() && pending_renames_.front().deadline <= now)
+            flush_rename(pending_renames_.begin());
+
+        if (!pending_renames_.empty())
+        {
+            rename_timer_armed_ = true;
+            rename_timer_.expires_at(pending_renames_.front().deadline);
+            async_wait(rename_timer_, &dir_monitor_impl::expire_renames);
+        }
+    }
+
+    // Moved out of the watched directories.
+    void flush_rename(pending_renames_t::iterator rename)
+    {
+        unindex_rename(rename);
+        compact_dir_monitor_event ev(std::move(rename->source));
+        pending_renames_.erase(rename);
+        ev.type = dir_monitor_event::removed;
+        emit(std::move(ev));
+    }
+
+    void unindex_rename(pending_renames_t::iterator rename)
+    {
+        rename_cookies_.erase(rename->cookie);
+        rename_paths_t::iterator path = rename_paths_.find(rename_key_of(rename->source));
+        if (path != rename_paths_.end() && path->second == rename)
+            rename_paths_.erase(path);
+    }
+
+    static rename_key_t rename_key_of(const compact_dir_monitor_event &ev)
+    {
+        return rename_key_t(ev.directory()->id, boost::string_ref(ev.name(), ev.name_size()));
+    }
+
+    /**
+     * Keeps the listing of wd in step with an event. Returns false if the
+     * event repeats a change the last resync already reported.
+     */
+    bool update_listing(int wd, watch_state &watch, const char *leaf, dir_monitor_event::event_type type)
+    {
+        bool added = type == dir_monitor_event::added || type == dir_monitor_event::renamed_new_name;
+        bool removed = type == dir_monitor_event::removed || type == dir_monitor_event::renamed_old_name;
+        if (!added && !removed)
+            return true;
+
+        const std::string name(leaf);
+        if (!watch.scanned || watch.resyncs != 0)
+            watch.touched.insert(name);
+        listing_entry entry = listing_entry();
+        if (added)
+            stat_entry(watch.location + "/" + name, entry);
+
+        if (added)
+            watch.listing[name] = entry;
+        else
+            watch.listing.erase(name);
+
+        resynced_t::iterator resynced = resynced_.find(wd);
+        if (resynced != resynced_.end())
+        {
+            auto reported = resynced->second.find(name);
+            if (reported != resynced->second.end() && reported->second == (added ? dir_monitor_event::added : dir_monitor_event::removed))
+            {
+                resynced->second.erase(reported);
+                return false;
+            }
         }
+        return true;
+    }
+
+    /**
+     * The kernel queue overflowed and events were lost. Every watched
+     * directory is listed again on the registration thread, so that
+     * reading, which is what the kernel queue is waiting for, carries on
+     * meanwhile; merge_resync() then reports the differences as synthetic
+     * added/removed/modified events.
+     */
+    void resync()
+    {
+        emit(compact_dir_monitor_event(compact_dir_monitor_event::directory_ptr(), "", 0, dir_monitor_event::overflow));
+
+        typedef std::tuple<int, compact_dir_monitor_event::directory_ptr, std::string> resync_t;
+        std::shared_ptr<std::vector<resync_t> > directories = std::make_shared<std::vector<resync_t> >();
+        for (int wd : watches_.descriptors())
+        {
+            watch_state *state = watches_.find(wd);
+            if (!state)
+                continue;
+            ++state->resyncs;
+            directories->push_back(resync_t(wd, state->directory, state->location));
+        }
+
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->registration_strand(), [self, directories]
+        {
+            for (const auto &directory : *directories)
+            {
+                std::shared_ptr<dir_monitor_impl> impl = self.lock();
+                if (!impl || impl->registration_stopped_)
+                    return;
+                const int wd = std::get<0>(directory);
+                const compact_dir_monitor_event::directory_ptr dir = std::get<1>(directory);
+                boost::system::error_code ec;
+                std::shared_ptr<listing_t> listing = std::make_shared<listing_t>(scan(std::get<2>(directory), ec));
+                boost::asio::post(impl->reader_->strand(), [self, wd, dir, listing, ec]
+                {
+                    if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                        impl->merge_resync(wd, dir, *listing, ec);
+                });
+            }
+        });
     }
 
-    std::string get_dirname(int wd)
+    /**
+     * Runs on the inotify thread. Compares the listing taken after an
+     * overflow against the one kept for wd; names seen in events since are
+     * left to those events, and events for the rest that were queued
+     * before the listing are dropped. A directory that cannot be listed is
+     * reported as recursive_rescan instead.
+     *
+     * Entries modified before the overflow may be reported as modified once
+     * more, since listings only record mtime and size when they are scanned.
+     */
+    void merge_resync(int wd, const compact_dir_monitor_event::directory_ptr &directory, listing_t &current, const boost::system::error_code &ec)
     {
-        std::unique_lock<std::mutex> lock(watch_descriptors_mutex_);
-        watch_descriptors_t::left_map::iterator it = watch_descriptors_.left.find(wd);
-        return it != watch_descriptors_.left.end() ? it->second : "";
+        watch_state *state = watches_.find(wd);
+        if (!state || state->directory != directory)
+            return;
+        std::unordered_set<std::string> touched;
+        if (--state->resyncs == 0 && state->scanned)
+            touched.swap(state->touched);
+        else
+            touched = state->touched;
+
+        if (ec)
+        {
+            boost::system::error_code exists_ec;
+            if (boost::filesystem::exists(state->location, exists_ec))
+                emit(compact_dir_monitor_event(directory, "", 0, dir_monitor_event::recursive_rescan));
+            else
+            {
+                // The directory is gone along with its watch; its parent reports the removal.
+                reader_->remove_watch(this, wd);
+                watches_.erase(wd);
+            }
+            return;
+        }
+
+        const std::string &dirname = directory->path.native();
+        const std::string &location = state->location;
+        const unsigned events = state->events;
+        std::vector<std::pair<std::string, dir_monitor_event::event_type> > changes;
+        listing_t &previous = state->listing;
+        for (auto &entry : current)
+        {
+            if (touched.count(entry.first))
+                continue;
+            listing_t::iterator it = previous.find(entry.first);
+            if (it == previous.end())
+            {
+                changes.push_back(std::make_pair(entry.first, dir_monitor_event::added));
+                if (entry.second.directory)
+                    register_sub_directory(dirname + "/" + entry.first, location + "/" + entry.first, dir_monitor_options(events, directory->priority));
+                previous.insert(entry);
+            }
+            else if (it->second.mtime_sec != entry.second.mtime_sec || it->second.mtime_nsec != entry.second.mtime_nsec || it->second.size != entry.second.size)
+            {
+                changes.push_back(std::make_pair(entry.first, dir_monitor_event::modified));
+                it->second = entry.second;
+            }
+        }
+        for (listing_t::iterator it = previous.begin(); it != previous.end(); )
+        {
+            if (!touched.count(it->first) && current.find(it->first) == current.end())
+            {
+                changes.push_back(std::make_pair(it->first, dir_monitor_event::removed));
+                it = previous.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        for (const auto &change : changes)
+        {
+            if (!subscribed(events, change.second))
+                continue;
+            if (change.second != dir_monitor_event::modified)
+                resynced_[wd][change.first] = change.second;
+            emit(compact_dir_monitor_event(directory, change.first, change.second));
+        }
+    }
+
+    /**
+     * Installs the watch on dirname, found at location, alone and appends
+     * its subdirectories to sub_directories.
+     *
+     * The watch state is published before the directory is scanned, so no
+     * event is lost in between; merge_listing() then folds the scan in on
+     * the inotify thread. With report_existing (a directory that appeared
+     * while being watched) a directory that is already watched under the
+     * same name is left alone, and entries created before the watch was
+     * installed are reported as added.
+     */
+    bool watch_directory(const std::string &dirname, const std::string &location, const dir_monitor_options &options, bool report_existing,
+        std::vector<std::pair<std::string, std::string> > &sub_directories, boost::system::error_code &ec)
+    {
+        int wd = reader_->add_watch(shared_from_this(), location, inotify_mask(options), ec);
+        if (wd == -1)
+            return false;
+        if (report_existing && watches_.find(dirname) == wd)
+            return false;
+
+        watch_state state;
+        // Instances number their watches alike, so ids are interleaved.
+        const std::uint32_t id = static_cast<std::uint32_t>(wd) * instance_count_ + instance_index_;
+        state.directory = std::make_shared<const dir_monitor_directory>(id, dirname, options.priority);
+        state.location = location;
+        state.events = options.events;
+        state.scanned = false;
+        state.resyncs = 0;
+        compact_dir_monitor_event::directory_ptr directory = state.directory;
+        watches_.insert(wd, dirname, std::move(state));
+
+        boost::system::error_code scan_ec;
+        std::shared_ptr<listing_t> listing = std::make_shared<listing_t>(scan(location, scan_ec));
+        for (const auto &entry : *listing)
+        {
+            if (entry.second.directory)
+                sub_directories.push_back(std::make_pair(dirname + "/" + entry.first, location + "/" + entry.first));
+        }
+
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->strand(), [self, wd, directory, listing, report_existing]
+        {
+            if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                impl->merge_listing(wd, directory, *listing, report_existing);
+        });
+        return true;
+    }
+
+    /**
+     * Runs on the inotify thread. Names already seen in events are left to
+     * those events; the rest are added to the listing and, if report_existing,
+     * reported as added. Events for them queued before the scan are then
+     * dropped like after a resync.
+     */
+    void merge_listing(int wd, const compact_dir_monitor_event::directory_ptr &directory, listing_t &listing, bool report_existing)
+    {
+        watch_state *watch = watches_.find(wd);
+        if (!watch || watch->directory != directory)
+            return;
+
+        for (auto &entry : listing)
+        {
+            if (watch->touched.count(entry.first))
+                continue;
+            watch->listing[entry.first] = entry.second;
+            if (report_existing && subscribed(watch->events, dir_monitor_event::added))
+            {
+                resynced_[wd][entry.first] = dir_monitor_event::added;
+                emit(compact_dir_monitor_event(directory, entry.first, dir_monitor_event::added));
+            }
+        }
+        watch->scanned = true;
+        if (watch->resyncs == 0)
+            watch->touched.clear();
     }
 
-    int fd_;
-    bool run_;
-    boost::asio::io_service inotify_io_service_;
-    std::unique_ptr<boost::asio::io_service::work> inotify_work_;
-    std::thread inotify_work_thread_;
-    
-    std::unique_ptr<boost::asio::posix::stream_descriptor> stream_descriptor_;
-    std::array<char, 4096> read_buffer_;
-    std::string pending_read_buffer_;
-    std::mutex watch_descriptors_mutex_;
-    typedef boost::bimap<int, std::string> watch_descriptors_t;
-    watch_descriptors_t watch_descriptors_;
-    std::mutex events_mutex_;
-    std::condition_variable events_cond_;
-    std::deque<dir_monitor_event> events_;
+    /**
+     * Has the tree at dirname listed every options.poll_interval instead of
+     * watched, by a poller started with the first such directory. Its
+     * events are posted to the reader thread and go on from there like
+     * any other.
+     */
+    std::size_t poll_tree(const std::string &dirname, const dir_monitor_options &options, boost::system::error_code &ec)
+    {
+        std::lock_guard<std::mutex> lock(poller_mutex_);
+        if (registration_stopped_)
+        {
+            ec = boost::asio::error::operation_aborted;
+            return 0;
+        }
+        if (!poller_)
+        {
+            std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+            std::shared_ptr<reader_type> reader = reader_;
+            poller_.reset(new polling_dir_monitor_impl([self, reader](const dir_monitor_event &ev, const dir_monitor_options &options)
+            {
+                const dir_monitor_priority priority = options.priority;
+                boost::asio::post(reader->strand(), [self, ev, priority]
+                {
+                    if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                        impl->emit_polled(ev, priority);
+                });
+            }));
+        }
+
+        try
+        {
+            poller_->add_directory(dirname, options);
+        }
+        catch (const boost::system::system_error &e)
+        {
+            ec = e.code();
+            return 0;
+        }
+        ec = boost::system::error_code();
+        return 1;
+    }
+
+    /**
+     * Runs on the inotify thread. Directories of polled events are interned
+     * like watched ones, with ids counting down from the top so as not to
+     * meet watch descriptors.
+     */
+    void emit_polled(const dir_monitor_event &ev, dir_monitor_priority priority)
+    {
+        const std::string dirname = ev.path.parent_path().native();
+        compact_dir_monitor_event::directory_ptr &directory = polled_directories_[dirname];
+        if (!directory || directory->priority != priority)
+            directory = std::make_shared<const dir_monitor_directory>(next_polled_id_--, dirname, priority);
+        emit(compact_dir_monitor_event(directory, ev.path.filename().native(), ev.type));
+    }
+
+    // Drops the directories interned for dirname and below. Inotify thread.
+    void forget_polled(const std::string &dirname)
+    {
+        for (auto it = polled_directories_.begin(); it != polled_directories_.end(); )
+        {
+            const std::string &path = it->first;
+            if (path.compare(0, dirname.size(), dirname) == 0 &&
+                (path.size() == dirname.size() || path[dirname.size()] == '/'))
+                it = polled_directories_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /**
+     * Has a directory found by the reader watched on the registration
+     * thread, so that reading never waits for a subtree to be walked.
+     */
+    void register_sub_directory(const std::string &dirname, const std::string &location, const dir_monitor_options &options)
+    {
+        std::weak_ptr<dir_monitor_impl> self(shared_from_this());
+        boost::asio::post(reader_->registration_strand(), [self, dirname, location, options]
+        {
+            boost::system::error_code ec;
+            if (std::shared_ptr<dir_monitor_impl> impl = self.lock())
+                impl->watch_tree(dirname, options, [](std::size_t) {}, ec, true, location);
+        });
+    }
+
+    static bool stat_entry(const std::string &path, listing_entry &entry)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 && ::lstat(path.c_str(), &st) != 0)
+            return false;
+
+        entry.directory = S_ISDIR(st.st_mode);
+        entry.mtime_sec = st.st_mtim.tv_sec;
+        entry.mtime_nsec = st.st_mtim.tv_nsec;
+        entry.size = st.st_size;
+        return true;
+    }
+
+    static listing_t scan(const std::string &dirname, boost::system::error_code &ec)
+    {
+        listing_t listing;
+        boost::filesystem::directory_iterator end;
+        for (boost::filesystem::directory_iterator iter(dirname, ec); !ec && iter != end; iter.increment(ec))
+        {
+            listing_entry entry;
+            if (stat_entry(iter->path().string(), entry))
+                listing.insert(listing_t::value_type(iter->path().filename().string(), entry));
+        }
+        return listing;
+    }
+
+    /**
+     * The smallest mask that delivers what options selects.
+     */
+    static uint32_t inotify_mask(const dir_monitor_options &options)
+    {
+        // New and moved subdirectories are watched whether or not creations
+        // and renames are reported.
+        uint32_t mask = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO;
+        if (options.events & dir_monitor_options::created_removed)
+            mask |= IN_DELETE;
+        if (options.events & dir_monitor_options::modifications)
+            mask |= IN_MODIFY;
+        if (options.events & dir_monitor_options::close_write)
+            mask |= IN_CLOSE_WRITE;
+        if (options.events & dir_monitor_options::attributes)
+            mask |= IN_ATTRIB;
+        return mask;
+    }
+
+    static bool subscribed(unsigned events, dir_monitor_event::event_type type)
+    {
+        switch (type)
+        {
+        case dir_monitor_event::added:
+        case dir_monitor_event::removed:
+            return (events & dir_monitor_options::created_removed) != 0;
+        case dir_monitor_event::renamed_old_name:
+        case dir_monitor_event::renamed_new_name:
+            return (events & dir_monitor_options::renames) != 0;
+        case dir_monitor_event::modified:
+            return (events & (dir_monitor_options::modifications | dir_monitor_options::close_write)) != 0;
+        case dir_monitor_event::metadata_changed:
+            return (events & dir_monitor_options::attributes) != 0;
+        default:
+            return true;
+        }
+    }
+
+    // Declared first so that timers on its io_service go before it does.
+    std::shared_ptr<reader_type> reader_;
+    std::atomic<bool> registration_stopped_;
+
+    // IN_MOVED_FROM records waiting for their IN_MOVED_TO, in the order
+    // they were read, by cookie and by path.
+    pending_renames_t pending_renames_;
+    rename_cookies_t rename_cookies_;
+    rename_paths_t rename_paths_;
+    boost::asio::steady_timer rename_timer_;
+    bool rename_timer_armed_;
+    std::atomic<std::chrono::milliseconds::rep> rename_timeout_;
+
+    dir_monitor_event_coalescer coalescer_;
+    boost::asio::steady_timer coalesce_timer_;
+    bool coalesce_timer_armed_;
+    // Read by the inotify thread without locking; see watch_table.
+    watch_table<watch_state> watches_;
+    // Names reported by the last resync, per wd, until the events queued before it are read.
+    typedef std::unordered_map<int, std::unordered_map<std::string, dir_monitor_event::event_type> > resynced_t;
+    resynced_t resynced_;
+    event_queue<compact_dir_monitor_event> events_;
+    // The queue limit; everything but the atomics is only touched by the reader thread.
+    std::atomic<std::size_t> queue_capacity_;
+    dir_monitor_queue_policy queue_policy_;
+    // Held back by queue_backpressure, in order.
+    std::deque<compact_dir_monitor_event> held_back_;
+    // Held back by queue_coalesce_per_path, without deadlines.
+    dir_monitor_event_coalescer held_events_;
+    // Held back by queue_rescan_directory.
+    std::vector<compact_dir_monitor_event::directory_ptr> held_rescans_;
+    std::unordered_set<std::uint32_t> held_rescan_ids_;
+    std::atomic<bool> overflowing_;
+    std::atomic<bool> flush_scheduled_;
+    std::atomic<bool> paused_;
+    std::size_t high_watermark_;
+    bool above_high_watermark_;
+    std::function<void(std::size_t)> high_watermark_callback_;
+    std::mutex operations_mutex_;
+    operation *first_operation_;
+    operation *last_operation_;
+    std::atomic<std::size_t> waiting_operations_;
+    // Everything below is guarded by operations_mutex_.
+    std::vector<std::unique_ptr<boost::asio::io_service::strand> > strands_;
+    bool shard_by_directory_;
+    std::vector<compact_dir_monitor_event> completed_events_;
+
+    // Further inotify instances feeding the queue of this monitor, set up
+    // before any directory is added; see set_inotify_instances().
+    std::vector<std::shared_ptr<dir_monitor_impl> > instances_;
+    // The monitor an instance feeds.
+    dir_monitor_impl *merge_into_;
+    std::atomic<bool> merging_;
+    std::mutex merge_mutex_;
+    std::uint32_t instance_index_;
+    std::uint32_t instance_count_;
+
+    // Lists the directories added with a poll_interval; see poll_tree().
+    std::mutex poller_mutex_;
+    std::unique_ptr<polling_dir_monitor_impl> poller_;
+    // Only touched on the inotify thread.
+    std::unordered_map<std::string, compact_dir_monitor_event::directory_ptr> polled_directories_;
+    std::uint32_t next_polled_id_;
 };
 
 }
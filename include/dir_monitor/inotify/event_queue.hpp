@@ -0,0 +1,404 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace boost {
+namespace asio {
+
+/**
+ * FIFO queue between one producer and any number of consumers, split into
+ * lanes: consumers take from the highest lane that has values.
+ *
+ * Values go through a fixed ring of slots per lane, each guarded by a
+ * sequence number (Vyukov's bounded queue), so neither side takes a lock or
+ * allocates while the ring has room. Should a ring fill up, further values
+ * spill into a list under a mutex until consumers have drained it; nothing
+ * is dropped.
+ *
+ * With a starvation limit, a lower lane that has been passed over for that
+ * many values in a row gets the next turn.
+ *
+ * Consumers that find the queue empty park on a condition variable, and
+ * the producer only touches it while somebody is parked.
+ *
+ * push() calls must not overlap; everything else, push_front() included,
+ * may be called from any thread.
+ */
+template <typename T>
+class event_queue
+{
+public:
+    explicit event_queue(std::size_t capacity, std::size_t lanes = 1)
+        : lane_count_(lanes),
+        lanes_(new lane[lanes]),
+        starvation_limit_(0),
+        passed_over_(0),
+        waiters_(0),
+        closed_(false)
+    {
+        for (std::size_t i = 0; i < lane_count_; ++i)
+            lanes_[i].init(capacity);
+    }
+
+    event_queue(const event_queue&) = delete;
+    event_queue &operator=(const event_queue&) = delete;
+
+    /**
+     * Appends value to lane and wakes a parked consumer. Returns false,
+     * leaving value alone, once the queue is closed.
+     */
+    bool push(T &value, std::size_t lane = 0)
+    {
+        if (closed_.load(std::memory_order_acquire))
+            return false;
+
+        lanes_[lane].push(value);
+
+        // Pairs with the fence in pop(): either a parked consumer is seen
+        // here, or it sees the value before it parks.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) != 0)
+        {
+            std::lock_guard<std::mutex> lock(park_mutex_);
+            park_cond_.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * Puts value back ahead of everything in lane, for a consumer that took
+     * more than it could use, and wakes a parked consumer.
+     */
+    void push_front(T &value, std::size_t lane = 0)
+    {
+        lanes_[lane].push_front(value);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) != 0)
+        {
+            std::lock_guard<std::mutex> lock(park_mutex_);
+            park_cond_.notify_one();
+        }
+    }
+
+    /**
+     * Takes the oldest value of the highest lane that has one, unless a
+     * lower lane is due. Does not look at closed().
+     */
+    bool try_pop(T &value)
+    {
+        const std::size_t limit = starvation_limit_.load(std::memory_order_relaxed);
+        if (limit != 0 && passed_over_.load(std::memory_order_relaxed) >= limit && try_pop_lowest(value))
+        {
+            passed_over_.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        for (std::size_t i = lane_count_; i-- > 0; )
+        {
+            if (!lanes_[i].try_pop(value))
+                continue;
+            if (limit != 0)
+            {
+                if (lower_lanes_empty(i))
+                    passed_over_.store(0, std::memory_order_relaxed);
+                else
+                    passed_over_.fetch_add(1, std::memory_order_relaxed);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Takes the oldest value of the lowest lane that has one.
+     */
+    bool try_pop_lowest(T &value)
+    {
+        for (std::size_t i = 0; i < lane_count_; ++i)
+        {
+            if (lanes_[i].try_pop(value))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Waits for a value. Returns false once the queue is closed, even if
+     * values are left.
+     */
+    bool pop(T &value)
+    {
+        for (;;)
+        {
+            if (closed_.load(std::memory_order_acquire))
+                return false;
+            if (try_pop(value))
+                return true;
+
+            std::unique_lock<std::mutex> lock(park_mutex_);
+            waiters_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool popped = !closed_.load(std::memory_order_acquire) && try_pop(value);
+            if (!popped && !closed_.load(std::memory_order_acquire))
+                park_cond_.wait(lock);
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+            if (popped)
+                return true;
+        }
+    }
+
+    /**
+     * pop() that gives up at deadline. Returns false once the queue is
+     * closed or the deadline has passed; closed() tells which.
+     */
+    template <typename Clock, typename Duration>
+    bool pop_until(T &value, const std::chrono::time_point<Clock, Duration> &deadline)
+    {
+        for (;;)
+        {
+            if (closed_.load(std::memory_order_acquire))
+                return false;
+            if (try_pop(value))
+                return true;
+
+            std::unique_lock<std::mutex> lock(park_mutex_);
+            waiters_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool popped = !closed_.load(std::memory_order_acquire) && try_pop(value);
+            bool expired = false;
+            if (!popped && !closed_.load(std::memory_order_acquire))
+                expired = park_cond_.wait_until(lock, deadline) == std::cv_status::timeout;
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+            if (popped)
+                return true;
+            if (expired)
+                return !closed_.load(std::memory_order_acquire) && try_pop(value);
+        }
+    }
+
+    /**
+     * Rejects further values and wakes every parked consumer.
+     */
+    void close()
+    {
+        closed_.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        park_cond_.notify_all();
+    }
+
+    bool closed() const
+    {
+        return closed_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Values queued in all lanes; only a snapshot while the queue is in use.
+     */
+    std::size_t size() const
+    {
+        std::size_t size = 0;
+        for (std::size_t i = 0; i < lane_count_; ++i)
+            size += lanes_[i].size();
+        return size;
+    }
+
+    /**
+     * How many values in a row a waiting lower lane may be passed over for;
+     * zero, the default, serves lanes strictly by rank.
+     */
+    void set_starvation_limit(std::size_t limit)
+    {
+        starvation_limit_.store(limit, std::memory_order_relaxed);
+    }
+
+private:
+    class lane
+    {
+    public:
+        lane()
+            : mask_(0),
+            head_(0),
+            tail_(0),
+            spilled_(false),
+            spill_size_(0),
+            returned_(false)
+        {
+        }
+
+        void init(std::size_t capacity)
+        {
+            mask_ = ring_size(capacity) - 1;
+            cells_.reset(new cell[mask_ + 1]);
+            for (std::size_t i = 0; i <= mask_; ++i)
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        void push(T &value)
+        {
+            if (spilled_.load(std::memory_order_acquire) || !try_push(value))
+            {
+                std::lock_guard<std::mutex> lock(spill_mutex_);
+                if (spilled_.load(std::memory_order_relaxed) || !try_push(value))
+                {
+                    spill_.push_back(std::move(value));
+                    spill_size_.store(spill_.size() + front_.size(), std::memory_order_relaxed);
+                    spilled_.store(true, std::memory_order_release);
+                }
+            }
+        }
+
+        void push_front(T &value)
+        {
+            std::lock_guard<std::mutex> lock(spill_mutex_);
+            front_.push_front(std::move(value));
+            spill_size_.store(spill_.size() + front_.size(), std::memory_order_relaxed);
+            returned_.store(true, std::memory_order_release);
+        }
+
+        bool try_pop(T &value)
+        {
+            if (returned_.load(std::memory_order_acquire))
+            {
+                std::lock_guard<std::mutex> lock(spill_mutex_);
+                if (!front_.empty())
+                {
+                    value = std::move(front_.front());
+                    front_.pop_front();
+                    spill_size_.store(spill_.size() + front_.size(), std::memory_order_relaxed);
+                    returned_.store(!front_.empty(), std::memory_order_release);
+                    return true;
+                }
+            }
+            if (try_pop_ring(value))
+                return true;
+            if (!spilled_.load(std::memory_order_acquire))
+                return false;
+
+            std::lock_guard<std::mutex> lock(spill_mutex_);
+            // The producer leaves the ring alone while values are spilled, so
+            // whatever is still in it is older than the spill.
+            if (try_pop_ring(value))
+                return true;
+            if (spill_.empty())
+            {
+                spilled_.store(false, std::memory_order_release);
+                return false;
+            }
+            value = std::move(spill_.front());
+            spill_.pop_front();
+            spill_size_.store(spill_.size() + front_.size(), std::memory_order_relaxed);
+            if (spill_.empty())
+                spilled_.store(false, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t size() const
+        {
+            const std::size_t head = head_.load(std::memory_order_relaxed);
+            const std::size_t tail = tail_.load(std::memory_order_relaxed);
+            return (tail > head ? tail - head : 0) + spill_size_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct cell
+        {
+            std::atomic<std::size_t> sequence;
+            T value;
+        };
+
+        static std::size_t ring_size(std::size_t capacity)
+        {
+            std::size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+            return size;
+        }
+
+        bool try_push(T &value)
+        {
+            const std::size_t pos = tail_.load(std::memory_order_relaxed);
+            cell &c = cells_[pos & mask_];
+            if (c.sequence.load(std::memory_order_acquire) != pos)
+                return false;
+            c.value = std::move(value);
+            c.sequence.store(pos + 1, std::memory_order_release);
+            tail_.store(pos + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool try_pop_ring(T &value)
+        {
+            std::size_t pos = head_.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell &c = cells_[pos & mask_];
+                const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(c.sequence.load(std::memory_order_acquire)) - static_cast<std::ptrdiff_t>(pos + 1);
+                if (diff == 0)
+                {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        value = std::move(c.value);
+                        c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::size_t mask_;
+        std::unique_ptr<cell[]> cells_;
+        // Advanced by consumers.
+        std::atomic<std::size_t> head_;
+        // Advanced by the producer.
+        std::atomic<std::size_t> tail_;
+        std::atomic<bool> spilled_;
+        std::mutex spill_mutex_;
+        std::deque<T> spill_;
+        // Of spill_ and front_.
+        std::atomic<std::size_t> spill_size_;
+        // Put back by consumers, ahead of the ring; guarded by spill_mutex_.
+        std::deque<T> front_;
+        std::atomic<bool> returned_;
+    };
+
+    bool lower_lanes_empty(std::size_t lane) const
+    {
+        for (std::size_t i = 0; i < lane; ++i)
+        {
+            if (lanes_[i].size() != 0)
+                return false;
+        }
+        return true;
+    }
+
+    const std::size_t lane_count_;
+    std::unique_ptr<lane[]> lanes_;
+    std::atomic<std::size_t> starvation_limit_;
+    // Values taken from a higher lane in a row while a lower one waited.
+    std::atomic<std::size_t> passed_over_;
+    std::atomic<std::size_t> waiters_;
+    std::atomic<bool> closed_;
+    std::mutex park_mutex_;
+    std::condition_variable park_cond_;
+};
+
+}
+}
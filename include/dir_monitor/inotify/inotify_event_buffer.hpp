@@ -0,0 +1,138 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+#include <sys/inotify.h>
+#include <limits.h>
+
+namespace boost {
+namespace asio {
+
+/**
+ * Reusable read buffer for an inotify file descriptor.
+ *
+ * Reads go straight into the free space at the end of the buffer and
+ * complete inotify_event records are handed out in place. Only a partial
+ * trailing record (at most one) is ever moved, to the front of the buffer,
+ * so the next read can complete it.
+ */
+class inotify_event_buffer
+{
+public:
+    /**
+     * Smallest capacity that is guaranteed to hold any single record.
+     */
+    static std::size_t min_capacity() { return sizeof(inotify_event) + NAME_MAX + 1; }
+
+    explicit inotify_event_buffer(std::size_t capacity = 4096)
+        : capacity_((std::max)(capacity, min_capacity())),
+        data_(new char[capacity_]),
+        size_(0)
+    {
+    }
+
+    std::size_t capacity() const { return capacity_; }
+
+    /**
+     * Bytes of an incomplete record carried over from the previous read.
+     */
+    std::size_t pending() const { return size_; }
+
+    /**
+     * Grows the buffer to new_capacity bytes, keeping a pending partial record.
+     * Must not be called while a read into prepare() is outstanding.
+     */
+    void reserve(std::size_t new_capacity)
+    {
+        if (new_capacity <= capacity_)
+            return;
+
+        std::unique_ptr<char[]> data(new char[new_capacity]);
+        std::memcpy(data.get(), data_.get(), size_);
+        data_.swap(data);
+        capacity_ = new_capacity;
+    }
+
+    /**
+     * Free space to read into.
+     */
+    boost::asio::mutable_buffers_1 prepare()
+    {
+        return boost::asio::buffer(data_.get() + size_, capacity_ - size_);
+    }
+
+    /**
+     * Accounts for bytes_transferred bytes read into prepare() and calls
+     * handler(const inotify_event &) for every complete record.
+     * Returns the number of records handled.
+     */
+    template <typename Handler>
+    std::size_t commit(std::size_t bytes_transferred, Handler handler)
+    {
+        return commit(bytes_transferred, handler, [] { return false; });
+    }
+
+    /**
+     * commit() that stops before the next record once stop() returns true.
+     * The records left over stay in the buffer for the next commit(), which
+     * may read nothing new; no read may be made into prepare() before they
+     * are handled, as the space left may be too small for a record.
+     */
+    template <typename Handler, typename Stop>
+    std::size_t commit(std::size_t bytes_transferred, Handler handler, Stop stop)
+    {
+        size_ += bytes_transferred;
+
+        std::size_t offset = 0;
+        std::size_t count = 0;
+        while (size_ - offset >= sizeof(inotify_event) && !stop())
+        {
+            const inotify_event *iev = reinterpret_cast<const inotify_event*>(data_.get() + offset);
+            const std::size_t record_size = sizeof(inotify_event) + iev->len;
+            if (size_ - offset < record_size)
+                break;
+
+            handler(*iev);
+            offset += record_size;
+            ++count;
+        }
+
+        if (offset != 0)
+        {
+            std::memmove(data_.get(), data_.get() + offset, size_ - offset);
+            size_ -= offset;
+        }
+
+        return count;
+    }
+
+    /**
+     * True if a complete record is left over from a commit() that stopped.
+     */
+    bool complete() const
+    {
+        if (size_ < sizeof(inotify_event))
+            return false;
+        const inotify_event *iev = reinterpret_cast<const inotify_event*>(data_.get());
+        return size_ >= sizeof(inotify_event) + iev->len;
+    }
+
+private:
+    std::size_t capacity_;
+    std::unique_ptr<char[]> data_;
+    std::size_t size_;
+};
+
+}
+}
@@ -0,0 +1,598 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "inotify_event_buffer.hpp"
+#include "watch_table.hpp"
+#include "../basic_dir_monitor.hpp"
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/inotify.h>
+#include <errno.h>
+
+namespace boost {
+namespace asio {
+
+/**
+ * An inotify instance with the thread reading it and the thread watching
+ * new subdirectories, on behalf of one or more owners.
+ *
+ * A dedicated reader has a single owner and hands it every record. A shared
+ * reader serves any number of owners on one descriptor: watches are added
+ * with IN_MASK_ADD, so a directory watched by several owners has one wd
+ * carrying the union of their masks, and records are routed by wd to every
+ * owner of the watch. A wd is only removed from the kernel once its last
+ * owner lets go of it.
+ *
+ * A reader either runs its own reader and registration threads, or is read
+ * on an io_service it is given, running no threads at all. Either way its
+ * work runs on two strands, one for reading and one for registration, so
+ * a given io_service may be run by any number of threads.
+ *
+ * Owner must provide handle_event(const inotify_event&), called for each
+ * record, and read_complete(), called once the descriptor is drained if the
+ * owner was handed any records; both run on strand().
+ */
+template <typename Owner>
+class inotify_reader
+    : public std::enable_shared_from_this<inotify_reader<Owner> >
+{
+public:
+    static const std::size_t default_read_buffer_size = 4096;
+    static const std::size_t default_max_read_buffer_size = 256 * 1024;
+
+    /**
+     * Without an io_service the reader starts threads of its own; with one,
+     * records are read and subdirectories watched by whoever runs it.
+     */
+    explicit inotify_reader(bool shared, boost::asio::io_service *io_service = nullptr)
+        : fd_(init_fd()),
+        shared_(shared),
+        owners_(std::make_shared<owner_list>()),
+        last_notified_(nullptr),
+        own_io_service_(io_service ? nullptr : new boost::asio::io_service()),
+        own_registration_io_service_(io_service ? nullptr : new boost::asio::io_service()),
+        io_service_(io_service ? *io_service : *own_io_service_),
+        registration_io_service_(io_service ? *io_service : *own_registration_io_service_),
+        strand_(io_service_),
+        registration_strand_(registration_io_service_),
+        stream_descriptor_(new boost::asio::posix::stream_descriptor(io_service_, fd_)),
+        pauses_(0),
+        reading_(false),
+        read_buffer_(default_read_buffer_size),
+        initial_read_buffer_size_(default_read_buffer_size),
+        max_read_buffer_size_(default_max_read_buffer_size),
+        reads_(0),
+        read_bytes_(0),
+        full_reads_(0),
+        reactor_reads_(0),
+        read_buffer_capacity_(read_buffer_.capacity())
+    {
+        // Reads following a completed async_read_some() drain the descriptor until EAGAIN.
+        stream_descriptor_->non_blocking(true);
+        for (auto &bucket : read_histogram_)
+            bucket = 0;
+
+        if (own_io_service_)
+        {
+            work_.reset(new boost::asio::io_service::work(io_service_));
+            thread_ = std::thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+            registration_work_.reset(new boost::asio::io_service::work(registration_io_service_));
+            registration_thread_ = std::thread(boost::bind(&boost::asio::io_service::run, &registration_io_service_));
+        }
+    }
+
+    ~inotify_reader()
+    {
+        // No handler holds the reader any more, so nothing is reading.
+        join_threads();
+        stream_descriptor_.reset();
+    }
+
+    inotify_reader(const inotify_reader&) = delete;
+    inotify_reader &operator=(const inotify_reader&) = delete;
+
+    bool shared() const { return shared_; }
+
+    boost::asio::io_service &io_service() { return io_service_; }
+
+    /**
+     * Records are handled here, one at a time; owners post their own work
+     * (timers, listing merges) here too.
+     */
+    boost::asio::io_service::strand &strand() { return strand_; }
+
+    /**
+     * Subdirectories are watched here, one at a time, alongside reading.
+     */
+    boost::asio::io_service::strand &registration_strand() { return registration_strand_; }
+
+    void start()
+    {
+        begin_read();
+    }
+
+    /**
+     * Stops handing out records, after the record in hand, until every
+     * pause() is matched by a resume(). The records already read wait in
+     * the read buffer meanwhile, the others in the kernel queue. A shared
+     * reader pauses for all of its owners. Both must be called on strand().
+     */
+    void pause()
+    {
+        ++pauses_;
+    }
+
+    void resume()
+    {
+        if (--pauses_ != 0 || reading_)
+            return;
+        if (!read_buffer_.complete())
+        {
+            begin_read();
+            return;
+        }
+
+        // Not handed out from here: the caller may hold locks the owners take.
+        reading_ = true;
+        std::weak_ptr<inotify_reader> self(this->shared_from_this());
+        boost::asio::post(strand_, [self]
+            {
+                if (std::shared_ptr<inotify_reader> reader = self.lock())
+                    reader->handle_read(0);
+            });
+    }
+
+    /**
+     * Joins the threads, if any, and closes the descriptor. Records still
+     * queued in the kernel are discarded.
+     *
+     * Without threads of its own a read may be under way on any thread
+     * running the io_service, so the descriptor is closed on strand()
+     * once that read is done, right away if called there. Waiting for it
+     * could block the only thread that would run it.
+     */
+    void stop()
+    {
+        if (join_threads())
+        {
+            stream_descriptor_.reset();
+            return;
+        }
+        std::shared_ptr<inotify_reader> self(this->shared_from_this());
+        boost::asio::dispatch(strand_, [self] { self->stream_descriptor_.reset(); });
+    }
+
+    /**
+     * Starts routing records to owner. A dedicated reader takes exactly one
+     * owner, which it only holds while it reads records for it.
+     */
+    void attach(const std::shared_ptr<Owner> &owner)
+    {
+        if (!shared_)
+        {
+            owner_ = owner;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        owned_[owner.get()];
+        std::shared_ptr<owner_list> owners = std::make_shared<owner_list>(*owners_);
+        owners->push_back(owner);
+        owners_ = owners;
+    }
+
+    /**
+     * Stops routing records to owner and drops it from every watch it
+     * holds; watches nobody else holds are removed. Later add_watch() calls
+     * for owner fail with operation_aborted.
+     */
+    void detach(Owner *owner)
+    {
+        if (!shared_)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        typename owned_t::iterator owned = owned_.find(owner);
+        if (owned == owned_.end())
+            return;
+        for (int wd : owned->second)
+            release_locked(owner, wd);
+        owned_.erase(owned);
+
+        std::shared_ptr<owner_list> owners = std::make_shared<owner_list>();
+        for (const auto &other : *owners_)
+        {
+            if (other.lock().get() != owner && !other.expired())
+                owners->push_back(other);
+        }
+        owners_ = owners;
+    }
+
+    /**
+     * inotify_add_watch() on behalf of owner. Returns the wd, or -1 with ec
+     * set.
+     */
+    int add_watch(const std::shared_ptr<Owner> &owner, const std::string &path, uint32_t mask, boost::system::error_code &ec)
+    {
+        if (!shared_)
+            return add_watch(path, mask, ec);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        typename owned_t::iterator owned = owned_.find(owner.get());
+        if (owned == owned_.end())
+        {
+            ec = boost::asio::error::operation_aborted;
+            return -1;
+        }
+
+        int wd = add_watch(path, mask | IN_MASK_ADD, ec);
+        if (wd == -1)
+            return -1;
+        if (owned->second.insert(wd).second)
+        {
+            watch_owners *current = routes_.find(wd);
+            watch_owners owners = current ? *current : watch_owners();
+            owners.push_back(std::make_pair(owner.get(), std::weak_ptr<Owner>(owner)));
+            routes_.insert(wd, path, std::move(owners));
+        }
+        return wd;
+    }
+
+    /**
+     * inotify_rm_watch() on behalf of owner; on a shared reader the watch
+     * stays while other owners hold it.
+     */
+    void remove_watch(Owner *owner, int wd)
+    {
+        if (!shared_)
+        {
+            inotify_rm_watch(fd_, wd);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        typename owned_t::iterator owned = owned_.find(owner);
+        if (owned != owned_.end() && owned->second.erase(wd))
+            release_locked(owner, wd);
+    }
+
+    /**
+     * The read buffer starts at initial_size bytes and doubles whenever a read
+     * fills it, up to max_size bytes. Applied once the read in progress completes.
+     */
+    void set_read_buffer_size(std::size_t initial_size, std::size_t max_size)
+    {
+        initial_read_buffer_size_ = initial_size;
+        max_read_buffer_size_ = (std::max)(initial_size, max_size);
+    }
+
+    dir_monitor_read_statistics read_statistics() const
+    {
+        dir_monitor_read_statistics stats;
+        for (std::size_t i = 0; i < read_histogram_.size(); ++i)
+            stats.histogram[i] = read_histogram_[i].load(std::memory_order_relaxed);
+        stats.reads = reads_.load(std::memory_order_relaxed);
+        stats.bytes = read_bytes_.load(std::memory_order_relaxed);
+        stats.full_reads = full_reads_.load(std::memory_order_relaxed);
+        stats.reactor_reads = reactor_reads_.load(std::memory_order_relaxed);
+        stats.buffer_capacity = read_buffer_capacity_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    typedef std::vector<std::pair<Owner*, std::weak_ptr<Owner> > > watch_owners;
+    typedef std::vector<std::weak_ptr<Owner> > owner_list;
+    typedef std::unordered_map<Owner*, std::unordered_set<int> > owned_t;
+
+    int init_fd()
+    {
+        int fd = inotify_init();
+        if (fd == -1)
+        {
+            boost::system::system_error e(boost::system::error_code(errno, boost::system::system_category()), "boost::asio::inotify_reader::init_fd: init_inotify failed");
+            boost::throw_exception(e);
+        }
+        return fd;
+    }
+
+    int add_watch(const std::string &path, uint32_t mask, boost::system::error_code &ec)
+    {
+        int wd = inotify_add_watch(fd_, path.c_str(), mask);
+        if (wd == -1)
+            ec = boost::system::error_code(errno, boost::system::system_category());
+        return wd;
+    }
+
+    // Drops owner from the route of wd, removing the watch if it was the last.
+    void release_locked(Owner *owner, int wd)
+    {
+        watch_owners *current = routes_.find(wd);
+        if (!current)
+            return;
+        watch_owners owners;
+        for (const auto &other : *current)
+        {
+            if (other.first != owner)
+                owners.push_back(other);
+        }
+        if (!owners.empty())
+        {
+            routes_.insert(wd, routes_.path(wd), std::move(owners));
+            return;
+        }
+        routes_.erase(wd);
+        inotify_rm_watch(fd_, wd);
+    }
+
+    bool join_threads()
+    {
+        if (!registration_thread_.joinable())
+            return false;
+        registration_work_.reset();
+        registration_io_service_.stop();
+        registration_thread_.join();
+
+        work_.reset();
+        io_service_.stop();
+        thread_.join();
+        return true;
+    }
+
+    void begin_read()
+    {
+        // Closed by stop().
+        if (!stream_descriptor_)
+            return;
+        reading_ = true;
+        // On a borrowed io_service the aborted read may complete after the reader is gone.
+        std::weak_ptr<inotify_reader> self(this->shared_from_this());
+        stream_descriptor_->async_read_some(read_buffer_.prepare(), boost::asio::bind_executor(strand_,
+            [self](const boost::system::error_code &ec, std::size_t bytes_transferred)
+            {
+                if (std::shared_ptr<inotify_reader> reader = self.lock())
+                    reader->end_read(ec, bytes_transferred);
+            }));
+    }
+
+    void end_read(const boost::system::error_code &ec, std::size_t bytes_transferred)
+    {
+        if (!ec)
+        {
+            reactor_reads_.fetch_add(1, std::memory_order_relaxed);
+            handle_read(bytes_transferred);
+        }
+        else if (ec != boost::asio::error::operation_aborted)
+        {
+            boost::system::system_error e(ec);
+            boost::throw_exception(e);
+        }
+    }
+
+    /**
+     * Hands out the bytes_transferred bytes just read, drains the descriptor
+     * unless paused, completes the read and reads again. With nothing read
+     * it hands out the records a pause() left in the read buffer instead.
+     */
+    void handle_read(std::size_t bytes_transferred)
+    {
+        // A read that completed just before stop() closed the descriptor.
+        if (!stream_descriptor_)
+            return;
+
+        // Held for the whole read, so that it outlives the records
+        // handed to it even if destroyed on another thread meanwhile.
+        std::shared_ptr<Owner> owner;
+        if (!shared_ && !(owner = owner_.lock()))
+            return;
+
+        if (bytes_transferred != 0)
+            consume(bytes_transferred, owner.get());
+        else
+            parse(owner.get());
+
+        // Drain whatever else is queued before waiting in the reactor again.
+        boost::system::error_code read_ec;
+        while (!io_service_.stopped() && pauses_ == 0)
+        {
+            bytes_transferred = stream_descriptor_->read_some(read_buffer_.prepare(), read_ec);
+            if (read_ec)
+                break;
+            consume(bytes_transferred, owner.get());
+        }
+
+        if (read_ec && read_ec != boost::asio::error::would_block && read_ec != boost::asio::error::try_again)
+        {
+            boost::system::system_error e(read_ec);
+            boost::throw_exception(e);
+        }
+
+        if (!shared_)
+            owner->read_complete();
+        else
+        {
+            // Owners nothing was read for have nothing to complete.
+            for (const auto &owner : notified_)
+                owner->read_complete();
+            notified_.clear();
+            notified_set_.clear();
+            last_notified_ = nullptr;
+            // No route is held across reads.
+            routes_.reclaim();
+        }
+
+        // Picked up again by resume().
+        reading_ = false;
+        if (pauses_ == 0)
+            begin_read();
+    }
+
+    // owner is the owner of a dedicated reader, null for a shared one.
+    void consume(std::size_t bytes_transferred, Owner *owner)
+    {
+        const std::size_t free_space = read_buffer_.capacity() - read_buffer_.pending();
+        const bool full = bytes_transferred + inotify_event_buffer::min_capacity() > free_space;
+        record_read(bytes_transferred, full);
+
+        read_buffer_.commit(bytes_transferred, [this, owner](const inotify_event &iev) { dispatch(iev, owner); },
+            [this] { return pauses_ != 0; });
+
+        std::size_t capacity = read_buffer_.capacity();
+        const std::size_t max_capacity = max_read_buffer_size_;
+        if (full && capacity < max_capacity)
+            capacity = (std::min)(capacity * 2, max_capacity);
+        capacity = (std::max)(capacity, static_cast<std::size_t>(initial_read_buffer_size_));
+        if (capacity != read_buffer_.capacity())
+        {
+            read_buffer_.reserve(capacity);
+            read_buffer_capacity_.store(read_buffer_.capacity(), std::memory_order_relaxed);
+        }
+    }
+
+    void parse(Owner *owner)
+    {
+        read_buffer_.commit(0, [this, owner](const inotify_event &iev) { dispatch(iev, owner); },
+            [this] { return pauses_ != 0; });
+    }
+
+    void record_read(std::size_t bytes_transferred, bool full)
+    {
+        std::size_t bucket = 0;
+        while (bytes_transferred >> (bucket + 1) && bucket + 1 < read_histogram_.size())
+            ++bucket;
+        read_histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+        reads_.fetch_add(1, std::memory_order_relaxed);
+        read_bytes_.fetch_add(bytes_transferred, std::memory_order_relaxed);
+        if (full)
+            full_reads_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void dispatch(const inotify_event &iev, Owner *owner)
+    {
+        if (!shared_)
+        {
+            owner->handle_event(iev);
+            return;
+        }
+
+        // Lost records may have concerned anybody.
+        if (iev.mask & IN_Q_OVERFLOW)
+        {
+            for (const auto &owner : *current_owners())
+            {
+                if (std::shared_ptr<Owner> o = owner.lock())
+                    deliver(o, iev);
+            }
+            return;
+        }
+
+        const watch_owners *owners = routes_.find(iev.wd);
+        if (!owners)
+            return;
+        for (const auto &owner : *owners)
+        {
+            if (std::shared_ptr<Owner> o = owner.second.lock())
+                deliver(o, iev);
+        }
+
+        // The kernel dropped the watch, e.g. because the directory is gone.
+        if (iev.mask & IN_IGNORED)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (const watch_owners *current = routes_.find(iev.wd))
+            {
+                for (const auto &owner : *current)
+                {
+                    typename owned_t::iterator owned = owned_.find(owner.first);
+                    if (owned != owned_.end())
+                        owned->second.erase(iev.wd);
+                }
+                routes_.erase(iev.wd);
+            }
+        }
+    }
+
+    // Hands iev to owner and remembers to complete the read for it.
+    void deliver(const std::shared_ptr<Owner> &owner, const inotify_event &iev)
+    {
+        owner->handle_event(iev);
+        if (owner.get() != last_notified_)
+        {
+            last_notified_ = owner.get();
+            if (notified_set_.insert(owner.get()).second)
+                notified_.push_back(owner);
+        }
+    }
+
+    std::shared_ptr<const owner_list> current_owners()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return owners_;
+    }
+
+    int fd_;
+    const bool shared_;
+    // The owner of a dedicated reader.
+    std::weak_ptr<Owner> owner_;
+
+    // Everything below up to the threads is only used by a shared reader.
+    // Writers hold mutex_; the reader thread reads routes_ without it.
+    std::mutex mutex_;
+    std::shared_ptr<const owner_list> owners_;
+    owned_t owned_;
+    watch_table<watch_owners> routes_;
+    // Owners handed records since the last read completed; only touched
+    // on strand_.
+    std::vector<std::shared_ptr<Owner> > notified_;
+    std::unordered_set<Owner*> notified_set_;
+    Owner *last_notified_;
+
+    // Only set when the reader runs its own threads.
+    std::unique_ptr<boost::asio::io_service> own_io_service_;
+    std::unique_ptr<boost::asio::io_service> own_registration_io_service_;
+    boost::asio::io_service &io_service_;
+    boost::asio::io_service &registration_io_service_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::io_service::strand registration_strand_;
+    std::unique_ptr<boost::asio::io_service::work> work_;
+    std::thread thread_;
+    std::unique_ptr<boost::asio::io_service::work> registration_work_;
+    std::thread registration_thread_;
+
+    std::unique_ptr<boost::asio::posix::stream_descriptor> stream_descriptor_;
+    // Only touched on strand_.
+    int pauses_;
+    bool reading_;
+    inotify_event_buffer read_buffer_;
+    std::atomic<std::size_t> initial_read_buffer_size_;
+    std::atomic<std::size_t> max_read_buffer_size_;
+    std::array<std::atomic<std::uint64_t>, 20> read_histogram_;
+    std::atomic<std::uint64_t> reads_;
+    std::atomic<std::uint64_t> read_bytes_;
+    std::atomic<std::uint64_t> full_reads_;
+    std::atomic<std::uint64_t> reactor_reads_;
+    std::atomic<std::size_t> read_buffer_capacity_;
+};
+
+}
+}
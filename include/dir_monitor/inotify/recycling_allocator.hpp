@@ -0,0 +1,121 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+namespace boost {
+namespace asio {
+
+/**
+ * Allocator for asynchronous operations and their completions, used unless
+ * the handler brings an allocator of its own.
+ *
+ * Freed blocks of up to 1024 bytes are kept in a few lock-free slots per
+ * size class, shared by the whole process, and handed out again; blocks
+ * may be freed on another thread than the one that allocated them. An
+ * operation re-armed from its handler therefore settles on a couple of
+ * blocks that go round without touching the heap.
+ */
+template <typename T>
+class recycling_allocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef recycling_allocator<U> other;
+    };
+
+    recycling_allocator() { }
+
+    template <typename U>
+    recycling_allocator(const recycling_allocator<U>&) { }
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T*>(memory::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n)
+    {
+        memory::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const recycling_allocator<U>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const recycling_allocator<U>&) const { return false; }
+
+private:
+    class memory
+    {
+    public:
+        static void *allocate(std::size_t size)
+        {
+            const std::size_t size_class = size_class_of(size);
+            if (size_class == size_classes)
+                return ::operator new(size);
+            for (auto &slot : slots()[size_class])
+            {
+                if (void *p = slot.exchange(nullptr, std::memory_order_acquire))
+                    return p;
+            }
+            return ::operator new(class_size(size_class));
+        }
+
+        static void deallocate(void *p, std::size_t size)
+        {
+            const std::size_t size_class = size_class_of(size);
+            if (size_class < size_classes)
+            {
+                for (auto &slot : slots()[size_class])
+                {
+                    void *empty = nullptr;
+                    if (slot.compare_exchange_strong(empty, p, std::memory_order_release, std::memory_order_relaxed))
+                        return;
+                }
+            }
+            ::operator delete(p);
+        }
+
+    private:
+        // 64, 128, 256, 512 and 1024 bytes.
+        enum { size_classes = 5, slots_per_class = 4 };
+
+        typedef std::array<std::array<std::atomic<void*>, slots_per_class>, size_classes> slots_t;
+
+        static std::size_t class_size(std::size_t size_class)
+        {
+            return std::size_t(64) << size_class;
+        }
+
+        static std::size_t size_class_of(std::size_t size)
+        {
+            std::size_t size_class = 0;
+            while (size_class < size_classes && class_size(size_class) < size)
+                ++size_class;
+            return size_class;
+        }
+
+        static slots_t &slots()
+        {
+            // Never destroyed, so that blocks freed during exit are still welcome.
+            static slots_t *slots = new slots_t();
+            return *slots;
+        }
+    };
+};
+
+}
+}
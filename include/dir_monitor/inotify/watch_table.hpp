@@ -0,0 +1,408 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+
+/**
+ * Watch records indexed by inotify watch descriptor, plus a path to wd index
+ * and the parent/child tree of the watched directories.
+ *
+ * Watch descriptors are small, dense integers, so records live in fixed-size
+ * chunks of a flat array that find() reads with plain atomic loads. Writers
+ * are serialized by a mutex and never free anything a reader might still
+ * hold: replaced and erased records (and empty chunks) are retired, and only
+ * freed when the reader thread calls reclaim() at a point where it holds no
+ * records, RCU style. There must be a single such reader, a thread or a
+ * strand; everybody else only touches records through the writer functions.
+ */
+template <typename Record>
+class watch_table
+{
+public:
+    watch_table()
+        : chunks_(new chunk_directory(0))
+    {
+    }
+
+    ~watch_table()
+    {
+        chunk_directory *chunks = chunks_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < chunks->size; ++i)
+        {
+            chunk *c = chunks->chunks[i].load(std::memory_order_relaxed);
+            if (!c)
+                continue;
+            for (auto &slot : c->slots)
+                delete slot.load(std::memory_order_relaxed);
+            delete c;
+        }
+        delete chunks;
+    }
+
+    watch_table(const watch_table&) = delete;
+    watch_table &operator=(const watch_table&) = delete;
+
+    /**
+     * The record for wd, or null. Lock-free; the record stays valid until
+     * the reader thread calls reclaim().
+     */
+    Record *find(int wd) const
+    {
+        if (wd < 0)
+            return nullptr;
+        chunk_directory *chunks = chunks_.load(std::memory_order_acquire);
+        const std::size_t index = static_cast<std::size_t>(wd) / chunk_size;
+        if (index >= chunks->size)
+            return nullptr;
+        chunk *c = chunks->chunks[index].load(std::memory_order_acquire);
+        if (!c)
+            return nullptr;
+        node *n = c->slots[static_cast<std::size_t>(wd) % chunk_size].load(std::memory_order_acquire);
+        return n ? &n->record : nullptr;
+    }
+
+    /**
+     * The wd watching path, or -1.
+     */
+    int find(const std::string &path) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        path_index_t::const_iterator it = path_index_.find(path);
+        return it == path_index_.end() ? -1 : it->second;
+    }
+
+    /**
+     * The number of watches in the table.
+     */
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return path_index_.size();
+    }
+
+    /**
+     * The path wd watches, or an empty string.
+     */
+    std::string path(int wd) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        node *n = node_of(wd);
+        return n ? n->path : std::string();
+    }
+
+    /**
+     * Publishes record for wd, replacing (and retiring) any previous one.
+     */
+    void insert(int wd, const std::string &path, Record record)
+    {
+        std::unique_ptr<node> n(new node(std::move(record), path));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::atomic<node*> &slot = reserve(wd);
+        node *previous = slot.load(std::memory_order_relaxed);
+        if (previous)
+        {
+            unindex(wd, previous->path);
+            unlink(wd);
+            retired_.push_back(std::shared_ptr<const void>(std::unique_ptr<node>(previous)));
+        }
+        else
+            ++chunk_of(wd)->live;
+        path_index_[path] = wd;
+        link(wd, path);
+        slot.store(n.release(), std::memory_order_release);
+    }
+
+    /**
+     * Removes wd; returns false if it was not in the table.
+     */
+    bool erase(int wd)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return erase_locked(wd);
+    }
+
+    /**
+     * Removes the watch on path; returns its wd, or -1.
+     */
+    int erase(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        path_index_t::iterator it = path_index_.find(path);
+        if (it == path_index_.end())
+            return -1;
+        int wd = it->second;
+        erase_locked(wd);
+        return wd;
+    }
+
+    /**
+     * Removes the watch on path and every watch below it in the tree.
+     * Returns their wds.
+     */
+    std::vector<int> erase_tree(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::pair<int, std::string> > watches = subtree_locked(path);
+        std::vector<int> wds;
+        wds.reserve(watches.size());
+        for (const auto &watch : watches)
+        {
+            erase_locked(watch.first);
+            wds.push_back(watch.first);
+        }
+        return wds;
+    }
+
+    /**
+     * The watch on path and every watch below it, parents first, as wd and
+     * path pairs. Empty if path is not watched.
+     */
+    std::vector<std::pair<int, std::string> > subtree(const std::string &path) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return subtree_locked(path);
+    }
+
+    /**
+     * Every wd in the table.
+     */
+    std::vector<int> descriptors() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<int> wds;
+        wds.reserve(path_index_.size());
+        chunk_directory *chunks = chunks_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < chunks->size; ++i)
+        {
+            chunk *c = chunks->chunks[i].load(std::memory_order_relaxed);
+            for (std::size_t j = 0; c && j < chunk_size; ++j)
+            {
+                if (c->slots[j].load(std::memory_order_relaxed))
+                    wds.push_back(static_cast<int>(i * chunk_size + j));
+            }
+        }
+        return wds;
+    }
+
+    /**
+     * Frees what writers retired so far. Only the reader thread may call
+     * this, and only while it holds no record returned by find().
+     */
+    void reclaim()
+    {
+        std::vector<std::shared_ptr<const void> > retired;
+        std::unique_lock<std::mutex> lock(mutex_);
+        retired.swap(retired_);
+        lock.unlock();
+    }
+
+private:
+    enum { chunk_size = 1024 };
+
+    struct node
+    {
+        node(Record &&r, const std::string &p)
+            : record(std::move(r)), path(p) { }
+
+        Record record;
+        std::string path;
+    };
+
+    struct chunk
+    {
+        chunk()
+            : live(0)
+        {
+            for (auto &slot : slots)
+                slot.store(nullptr, std::memory_order_relaxed);
+        }
+
+        std::array<std::atomic<node*>, chunk_size> slots;
+        // Occupied slots; the chunk is retired when it drops to zero.
+        std::size_t live;
+    };
+
+    struct chunk_directory
+    {
+        explicit chunk_directory(std::size_t n)
+            : size(n), chunks(new std::atomic<chunk*>[n])
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        std::size_t size;
+        std::unique_ptr<std::atomic<chunk*>[]> chunks;
+    };
+
+    chunk *chunk_of(int wd) const
+    {
+        return chunks_.load(std::memory_order_relaxed)->chunks[static_cast<std::size_t>(wd) / chunk_size].load(std::memory_order_relaxed);
+    }
+
+    // Makes room for wd, growing the chunk directory by copy if needed.
+    std::atomic<node*> &reserve(int wd)
+    {
+        const std::size_t index = static_cast<std::size_t>(wd) / chunk_size;
+        chunk_directory *chunks = chunks_.load(std::memory_order_relaxed);
+        if (index >= chunks->size)
+        {
+            std::unique_ptr<chunk_directory> grown(new chunk_directory((std::max)(index + 1, chunks->size * 2)));
+            for (std::size_t i = 0; i < chunks->size; ++i)
+                grown->chunks[i].store(chunks->chunks[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            chunks_.store(grown.get(), std::memory_order_release);
+            retired_.push_back(std::shared_ptr<const void>(std::unique_ptr<chunk_directory>(chunks)));
+            chunks = grown.release();
+        }
+
+        chunk *c = chunks->chunks[index].load(std::memory_order_relaxed);
+        if (!c)
+        {
+            c = new chunk();
+            chunks->chunks[index].store(c, std::memory_order_release);
+        }
+        return c->slots[static_cast<std::size_t>(wd) % chunk_size];
+    }
+
+    bool erase_locked(int wd)
+    {
+        node *n = node_of(wd);
+        if (!n)
+            return false;
+
+        chunk_directory *chunks = chunks_.load(std::memory_order_relaxed);
+        const std::size_t index = static_cast<std::size_t>(wd) / chunk_size;
+        chunk *c = chunks->chunks[index].load(std::memory_order_relaxed);
+        c->slots[static_cast<std::size_t>(wd) % chunk_size].store(nullptr, std::memory_order_release);
+        unindex(wd, n->path);
+        unlink(wd);
+        typename tree_t::iterator links = tree_.find(wd);
+        if (links != tree_.end())
+        {
+            // Children left behind become roots of their own.
+            for (int child : links->second.children)
+                tree_[child].parent = -1;
+            tree_.erase(links);
+        }
+        retired_.push_back(std::shared_ptr<const void>(std::unique_ptr<node>(n)));
+        if (--c->live == 0)
+        {
+            chunks->chunks[index].store(nullptr, std::memory_order_release);
+            retired_.push_back(std::shared_ptr<const void>(std::unique_ptr<chunk>(c)));
+        }
+        return true;
+    }
+
+    // Drops path from the index unless it already names a newer watch.
+    void unindex(int wd, const std::string &path)
+    {
+        path_index_t::iterator it = path_index_.find(path);
+        if (it != path_index_.end() && it->second == wd)
+            path_index_.erase(it);
+    }
+
+    node *node_of(int wd) const
+    {
+        chunk_directory *chunks = chunks_.load(std::memory_order_relaxed);
+        const std::size_t index = static_cast<std::size_t>(wd) / chunk_size;
+        if (wd < 0 || index >= chunks->size)
+            return nullptr;
+        chunk *c = chunks->chunks[index].load(std::memory_order_relaxed);
+        return c ? c->slots[static_cast<std::size_t>(wd) % chunk_size].load(std::memory_order_relaxed) : nullptr;
+    }
+
+    // Hangs wd below the watch on the directory containing path, if any.
+    // Subdirectories are watched as parent + "/" + name, so cutting the last
+    // component gives back the parent exactly as it was added.
+    void link(int wd, const std::string &path)
+    {
+        tree_links &links = tree_[wd];
+        links.parent = -1;
+        std::string::size_type slash = path.find_last_of('/');
+        if (slash == std::string::npos)
+            return;
+        path_index_t::const_iterator parent = path_index_.find(path.substr(0, slash));
+        if (parent == path_index_.end() || parent->second == wd)
+            return;
+        links.parent = parent->second;
+        tree_[parent->second].children.insert(wd);
+    }
+
+    // Detaches wd from its parent; its own children stay attached.
+    void unlink(int wd)
+    {
+        typename tree_t::iterator it = tree_.find(wd);
+        if (it == tree_.end())
+            return;
+        if (it->second.parent != -1)
+        {
+            typename tree_t::iterator parent = tree_.find(it->second.parent);
+            if (parent != tree_.end())
+                parent->second.children.erase(wd);
+            it->second.parent = -1;
+        }
+    }
+
+    std::vector<std::pair<int, std::string> > subtree_locked(const std::string &path) const
+    {
+        std::vector<std::pair<int, std::string> > watches;
+        path_index_t::const_iterator root = path_index_.find(path);
+        if (root == path_index_.end())
+            return watches;
+
+        std::vector<int> pending(1, root->second);
+        while (!pending.empty())
+        {
+            int wd = pending.back();
+            pending.pop_back();
+            node *n = node_of(wd);
+            if (!n)
+                continue;
+            watches.push_back(std::make_pair(wd, n->path));
+            typename tree_t::const_iterator links = tree_.find(wd);
+            if (links != tree_.end())
+                pending.insert(pending.end(), links->second.children.begin(), links->second.children.end());
+        }
+        return watches;
+    }
+
+    std::atomic<chunk_directory*> chunks_;
+    mutable std::mutex mutex_;
+    typedef std::unordered_map<std::string, int> path_index_t;
+    path_index_t path_index_;
+    struct tree_links
+    {
+        tree_links()
+            : parent(-1) { }
+
+        int parent;
+        std::unordered_set<int> children;
+    };
+    // Only touched by writers.
+    typedef std::unordered_map<int, tree_links> tree_t;
+    tree_t tree_;
+    // Unlinked but possibly still in use by the reader; see reclaim().
+    std::vector<std::shared_ptr<const void> > retired_;
+};
+
+}
+}
@@ -34,10 +34,13 @@
 //
 #pragma once
 
+#include "../polling/dir_snapshot.hpp"
 #include <boost/filesystem.hpp>
 #include <boost/ptr_container/ptr_unordered_map.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
 #include <string>
 #include <deque>
 
@@ -75,7 +78,7 @@ class dir_monitor_impl
         int handle_;
     };
 
-    typedef std::map<std::string, boost::filesystem::directory_entry> dir_entry_map;
+    typedef dir_snapshot::dir_entry_map dir_entry_map;
 
 public:
     dir_monitor_impl()
@@ -140,7 +143,64 @@ public:
         }
     }
 
+    /**
+     * Takes the oldest event if there is one, without waiting.
+     */
+    boost::optional<dir_monitor_event> try_popfront_event(boost::system::error_code &ec)
+    {
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        return take_event(ec);
+    }
+
+    /**
+     * popfront_event() that gives up, returning nothing, after timeout.
+     */
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> popfront_event_for(const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        const boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now()
+            + boost::chrono::nanoseconds(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count());
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        while (run_ && events_.empty())
+        {
+            if (events_cond_.wait_until(lock, deadline) == boost::cv_status::timeout)
+                break;
+        }
+        return take_event(ec);
+    }
+
+    /**
+     * Moves up to max_events queued events to out under one lock; returns
+     * out past the last one.
+     */
+    template <typename OutputIterator>
+    OutputIterator drain_events(OutputIterator out, std::size_t max_events)
+    {
+        boost::unique_lock<boost::mutex> lock(events_mutex_);
+        for (; max_events != 0 && !events_.empty(); --max_events)
+        {
+            *out++ = events_.front();
+            events_.pop_front();
+        }
+        return out;
+    }
+
 private:
+    // Called with events_mutex_ held; events left at destroy() are still handed out.
+    boost::optional<dir_monitor_event> take_event(boost::system::error_code &ec)
+    {
+        ec = boost::system::error_code();
+        if (events_.empty())
+        {
+            if (!run_)
+                ec = boost::asio::error::operation_aborted;
+            return boost::none;
+        }
+        dir_monitor_event ev = events_.front();
+        events_.pop_front();
+        return ev;
+    }
+
     int init_kqueue()
     {
         int fd = kqueue();
@@ -155,49 +215,18 @@ private:
     void scan(std::string const& dir, dir_entry_map& entries)
     {
         boost::system::error_code ec;
-        boost::filesystem::recursive_directory_iterator it(dir, ec);
-        boost::filesystem::recursive_directory_iterator end;
-
+        dir_snapshot::scan(dir, entries, ec);
         if (ec)
         {
             boost::system::system_error e(ec, "boost::asio::dir_monitor_impl::scan: unable to iterate directories");
             boost::throw_exception(e);
         }
-
-        while (it != end)
-        {
-            entries[(*it).path().native()] = *it;
-            ++it;
-        }
     }
 
-    void compare(std::string const& dir, dir_entry_map& old_entries, dir_entry_map& new_entries)
+    void compare(dir_entry_map& old_entries, dir_entry_map& new_entries)
     {
-        // @todo filename() loses path relative to dir
-        // Need to construct with dir as a root_path() and get all paths relative to that.
-        for (dir_entry_map::iterator itn = new_entries.begin(); itn != new_entries.end(); ++itn)
-        {
-            dir_entry_map::iterator ito = old_entries.find(itn->first);
-            if (ito != old_entries.end())
-            {
-                if (!boost::filesystem::equivalent(itn->second.path(), ito->second.path()) or
-                    boost::filesystem::last_write_time(itn->second.path()) != boost::filesystem::last_write_time(ito->second.path()) or
-                    (boost::filesystem::is_regular_file(itn->second.path()) and boost::filesystem::is_regular_file(ito->second.path()) and
-                    boost::filesystem::file_size(itn->second.path()) != boost::filesystem::file_size(ito->second.path())))
-                {
-                    pushback_event(dir_monitor_event(boost::filesystem::path(dir) / itn->second.path().filename(), dir_monitor_event::modified));
-                }
-                old_entries.erase(ito);
-            }
-            else
-            {
-                pushback_event(dir_monitor_event(boost::filesystem::path(dir) / itn->second.path().filename(), dir_monitor_event::added));
-            }
-        }
-        for (dir_entry_map::iterator it = old_entries.begin(); it != old_entries.end(); ++it)
-        {
-            pushback_event(dir_monitor_event(boost::filesystem::path(dir) / it->second.path().filename(), dir_monitor_event::removed));
-        }
+        dir_snapshot::compare(old_entries, new_entries, dir_monitor_options::default_events,
+            [this](const dir_monitor_event &ev) { pushback_event(ev); });
     }
 
     void work_thread()
@@ -240,7 +269,7 @@ private:
 
                 dir_entry_map new_entries;
                 scan(dir->first, new_entries);
-                compare(dir->first, entries[dir->first], new_entries);
+                compare(entries[dir->first], new_entries);
                 std::swap(entries[dir->first], new_entries);
             }
         }
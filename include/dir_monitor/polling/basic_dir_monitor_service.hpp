@@ -0,0 +1,297 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "dir_monitor_impl.hpp"
+#include "../inotify/recycling_allocator.hpp"
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <utility>
+
+namespace boost {
+namespace asio {
+
+/**
+ * The polling backend, available on every platform next to the native one;
+ * see polling_dir_monitor_impl.
+ */
+template <typename DirMonitorImplementation = polling_dir_monitor_impl>
+class basic_polling_dir_monitor_service
+    : public boost::asio::io_service::service
+{
+public:
+    static boost::asio::io_service::id id;
+
+    explicit basic_polling_dir_monitor_service(boost::asio::io_service &io_service)
+        : boost::asio::io_service::service(io_service)
+    {
+    }
+
+    typedef std::shared_ptr<DirMonitorImplementation> implementation_type;
+
+    void construct(implementation_type &impl)
+    {
+        impl.reset(new DirMonitorImplementation());
+    }
+
+    void destroy(implementation_type &impl)
+    {
+        // Pending asynchronous calls complete with operation_aborted and
+        // blocked monitor() calls return.
+        impl->destroy();
+
+        impl.reset();
+    }
+
+    void add_directory(implementation_type &impl, const std::string &dirname, const dir_monitor_options &options = dir_monitor_options())
+    {
+        if (!boost::filesystem::is_directory(dirname))
+            throw std::invalid_argument("boost::asio::basic_polling_dir_monitor_service::add_directory: " + dirname + " is not a valid directory entry");
+
+        impl->add_directory(dirname, options);
+    }
+
+    void remove_directory(implementation_type &impl, const std::string &dirname)
+    {
+        impl->remove_directory(dirname);
+    }
+
+    void cancel(implementation_type &impl)
+    {
+        impl->cancel();
+    }
+
+    void set_poll_interval(implementation_type &impl, std::chrono::milliseconds interval)
+    {
+        impl->set_interval(interval);
+    }
+
+    dir_monitor_event monitor(implementation_type &impl, boost::system::error_code &ec)
+    {
+        return impl->popfront_event(ec);
+    }
+
+    boost::optional<dir_monitor_event> try_monitor(implementation_type &impl, boost::system::error_code &ec)
+    {
+        return impl->try_popfront_event(ec);
+    }
+
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> monitor_for(implementation_type &impl, const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        return impl->popfront_event_for(timeout, ec);
+    }
+
+    template <typename OutputIterator>
+    OutputIterator drain(implementation_type &impl, OutputIterator out, std::size_t max_events)
+    {
+        return impl->drain_events(out, max_events);
+    }
+
+    /**
+     * Posts the handler with the next event once one is queued. As with the
+     * inotify backend, the handler is only moved, the operation and its
+     * completion come from the handler's associated allocator, and the
+     * handler runs on its associated executor. With Boost 1.77 or later a
+     * handler with an associated cancellation slot can have its call
+     * completed with operation_aborted on its own.
+     */
+    template <typename Handler>
+    class monitor_operation
+        : public DirMonitorImplementation::operation
+    {
+    public:
+        typedef typename DirMonitorImplementation::operation_ptr operation_ptr;
+        typedef typename boost::asio::associated_allocator<Handler, recycling_allocator<void> >::type allocator_type;
+
+        static operation_ptr create(const implementation_type &impl, boost::asio::io_service &io_service, Handler &&handler)
+        {
+            allocator_type allocator = boost::asio::get_associated_allocator(handler, recycling_allocator<void>());
+#if BOOST_VERSION >= 107700
+            typename boost::asio::associated_cancellation_slot<Handler>::type slot = boost::asio::get_associated_cancellation_slot(handler);
+#endif
+            operation_allocator alloc(allocator);
+            monitor_operation *op = alloc.allocate(1);
+            try
+            {
+                new (op) monitor_operation(io_service, std::move(handler), allocator);
+            }
+            catch (...)
+            {
+                alloc.deallocate(op, 1);
+                throw;
+            }
+#if BOOST_VERSION >= 107700
+            if (slot.is_connected())
+            {
+                op->set_cancellation_handle(&slot.template emplace<cancellation_handler>(impl).op_);
+                op->cancellable_ = true;
+            }
+#else
+            (void)impl;
+#endif
+            return operation_ptr(op);
+        }
+
+        virtual void complete(const boost::system::error_code &ec, const dir_monitor_event &ev) override
+        {
+            completion c(std::move(handler_), ec, ev, allocator_, executor_);
+#if BOOST_VERSION >= 107700
+            c.cancellable_ = cancellable_;
+#endif
+            boost::asio::post(executor_, std::move(c));
+        }
+
+    protected:
+        virtual void destroy() override
+        {
+            operation_allocator alloc(allocator_);
+            this->~monitor_operation();
+            alloc.deallocate(this, 1);
+        }
+
+    private:
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<monitor_operation> operation_allocator;
+
+        typedef typename boost::asio::associated_executor<Handler, boost::asio::io_service::executor_type>::type executor_type;
+
+        monitor_operation(boost::asio::io_service &io_service, Handler &&handler, const allocator_type &allocator)
+            : work_(io_service),
+            executor_(boost::asio::get_associated_executor(handler, io_service.get_executor())),
+            handler_(std::move(handler)),
+            allocator_(allocator)
+#if BOOST_VERSION >= 107700
+            , cancellable_(false)
+#endif
+        {
+        }
+
+#if BOOST_VERSION >= 107700
+        // Lives in the handler's cancellation slot until the handler runs;
+        // op_ is reset by the implementation once the call has completed.
+        struct cancellation_handler
+        {
+            explicit cancellation_handler(const implementation_type &impl)
+                : impl_(impl),
+                op_(nullptr)
+            {
+            }
+
+            void operator()(boost::asio::cancellation_type_t type)
+            {
+                if (type == boost::asio::cancellation_type::none)
+                    return;
+                if (implementation_type impl = impl_.lock())
+                    impl->cancel_operation(&op_);
+            }
+
+            std::weak_ptr<DirMonitorImplementation> impl_;
+            typename DirMonitorImplementation::operation *op_;
+        };
+#endif
+
+        struct completion
+        {
+            typedef typename monitor_operation::allocator_type allocator_type;
+            typedef typename monitor_operation::executor_type executor_type;
+
+            completion(Handler &&handler, const boost::system::error_code &ec, const dir_monitor_event &ev,
+                const allocator_type &allocator, const executor_type &executor)
+                : handler_(std::move(handler)),
+                ec_(ec),
+                ev_(ev),
+                allocator_(allocator),
+                executor_(executor)
+#if BOOST_VERSION >= 107700
+                , cancellable_(false)
+#endif
+            {
+            }
+
+            allocator_type get_allocator() const noexcept
+            {
+                return allocator_;
+            }
+
+            executor_type get_executor() const noexcept
+            {
+                return executor_;
+            }
+
+            void operator()()
+            {
+#if BOOST_VERSION >= 107700
+                if (cancellable_)
+                    boost::asio::get_associated_cancellation_slot(handler_).clear();
+#endif
+                handler_(ec_, std::move(ev_));
+            }
+
+            // Keeps handlers wrapped by a strand running on it.
+            template <typename Function>
+            friend void asio_handler_invoke(Function &function, completion *this_handler)
+            {
+                boost_asio_handler_invoke_helpers::invoke(function, this_handler->handler_);
+            }
+
+            template <typename Function>
+            friend void asio_handler_invoke(const Function &function, completion *this_handler)
+            {
+                boost_asio_handler_invoke_helpers::invoke(function, this_handler->handler_);
+            }
+
+            Handler handler_;
+            boost::system::error_code ec_;
+            dir_monitor_event ev_;
+            allocator_type allocator_;
+            executor_type executor_;
+#if BOOST_VERSION >= 107700
+            bool cancellable_;
+#endif
+        };
+
+        boost::asio::io_service::work work_;
+        executor_type executor_;
+        Handler handler_;
+        allocator_type allocator_;
+#if BOOST_VERSION >= 107700
+        bool cancellable_;
+#endif
+    };
+
+    /**
+     * Kept by the monitor until an event is queued; no thread waits for it.
+     */
+    template <typename Handler>
+    void async_monitor(implementation_type &impl, Handler handler)
+    {
+        impl->async_popfront_event(monitor_operation<Handler>::create(impl, owner_io_service(), std::move(handler)));
+    }
+
+private:
+    boost::asio::io_service &owner_io_service()
+    {
+        return this->get_io_context();
+    }
+
+    virtual void shutdown_service() override
+    {
+    }
+};
+
+template <typename DirMonitorImplementation>
+boost::asio::io_service::id basic_polling_dir_monitor_service<DirMonitorImplementation>::id;
+
+}
+}
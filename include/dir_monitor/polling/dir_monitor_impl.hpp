@@ -0,0 +1,459 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "dir_snapshot.hpp"
+#include "../basic_dir_monitor.hpp"
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+
+/**
+ * Watches directories by listing them periodically on a thread of its own
+ * and reporting the differences; see dir_snapshot. Works on any file
+ * system, including those inotify does not cover (NFS, FUSE, some overlay
+ * mounts), at the cost of latency and of rescanning whole trees.
+ */
+class polling_dir_monitor_impl
+{
+public:
+    /**
+     * Receives the events of a directory, along with the options it was
+     * added with, instead of the queue.
+     */
+    typedef std::function<void(const dir_monitor_event&, const dir_monitor_options&)> sink_type;
+
+    /**
+     * An asynchronous monitor call waiting for an event.
+     */
+    class operation
+    {
+    public:
+        struct deleter
+        {
+            void operator()(operation *op) const { op->destroy(); }
+        };
+
+        /**
+         * Hands ev (empty if ec is set) to the handler. Called with the
+         * queue locked, from whichever thread completes the call, so this
+         * must only post the handler.
+         */
+        virtual void complete(const boost::system::error_code &ec, const dir_monitor_event &ev) = 0;
+
+    protected:
+        operation()
+            : handle_(nullptr)
+        {
+        }
+
+        ~operation() { }
+
+        /**
+         * Destroys the operation and frees its memory with the allocator it
+         * came from.
+         */
+        virtual void destroy() = 0;
+
+        /**
+         * Makes *handle point to the operation while it is pending, for
+         * cancel_operation(handle); it is reset when the operation completes.
+         */
+        void set_cancellation_handle(operation **handle)
+        {
+            handle_ = handle;
+            *handle = this;
+        }
+
+    private:
+        friend class polling_dir_monitor_impl;
+
+        operation **handle_;
+    };
+
+    typedef std::unique_ptr<operation, operation::deleter> operation_ptr;
+
+    static std::chrono::milliseconds default_interval() { return std::chrono::milliseconds(500); }
+
+    /**
+     * Events are queued for popfront_event(), or handed to sink on the
+     * polling thread if one is given.
+     */
+    explicit polling_dir_monitor_impl(sink_type sink = sink_type())
+        : sink_(std::move(sink)),
+        interval_(default_interval()),
+        run_(true),
+        generations_(0),
+        events_open_(true),
+        thread_(&polling_dir_monitor_impl::work_thread, this)
+    {
+    }
+
+    ~polling_dir_monitor_impl()
+    {
+        destroy();
+    }
+
+    polling_dir_monitor_impl(const polling_dir_monitor_impl&) = delete;
+    polling_dir_monitor_impl &operator=(const polling_dir_monitor_impl&) = delete;
+
+    /**
+     * How often directories added without a poll_interval of their own are
+     * listed. Takes effect after their next listing.
+     */
+    void set_interval(std::chrono::milliseconds interval)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        interval_ = interval;
+    }
+
+    /**
+     * Lists dirname right away; changes from then on are reported. Adding
+     * a directory again replaces its options and its listing.
+     */
+    void add_directory(const std::string &dirname, const dir_monitor_options &options = dir_monitor_options())
+    {
+        watched_directory dir;
+        dir.options = options;
+        boost::system::error_code ec;
+        dir_snapshot::scan(dirname, dir.snapshot, ec);
+        if (ec)
+        {
+            boost::system::system_error e(ec, "boost::asio::polling_dir_monitor_impl::add_directory: unable to iterate directories");
+            boost::throw_exception(e);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        dir.next = std::chrono::steady_clock::now() + interval_of(dir);
+        dir.generation = ++generations_;
+        dirs_[dirname] = std::move(dir);
+        cond_.notify_all();
+    }
+
+    /**
+     * Stops watching dirname and the directories added below it.
+     */
+    void remove_directory(const std::string &dirname)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (dirs_t::iterator it = dirs_.lower_bound(dirname); it != dirs_.end(); )
+        {
+            const std::string &path = it->first;
+            if (path.compare(0, dirname.size(), dirname) != 0)
+                break;
+            if (path.size() == dirname.size() || path[dirname.size()] == '/')
+                it = dirs_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /**
+     * Joins the polling thread and wakes up blocked calls, which return
+     * operation_aborted once the queue is empty.
+     */
+    void destroy()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            run_ = false;
+            cond_.notify_all();
+        }
+        if (thread_.joinable())
+            thread_.join();
+
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        events_open_ = false;
+        events_cond_.notify_all();
+        complete_operations();
+    }
+
+    /**
+     * Completes op with the next event once there is one, or with
+     * operation_aborted once it is cancelled or the monitor is destroyed.
+     * No thread waits meanwhile: op is kept until pushback_event(),
+     * cancel() or destroy() completes it. Operations complete in the order
+     * they were started.
+     */
+    void async_popfront_event(operation_ptr op)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        operations_.push_back(std::move(op));
+        complete_operations();
+    }
+
+    /**
+     * Completes every pending operation with operation_aborted; queued
+     * events stay queued for the next call.
+     */
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        std::deque<operation_ptr> operations;
+        operations.swap(operations_);
+        for (auto &op : operations)
+            finish(std::move(op), boost::asio::error::operation_aborted, dir_monitor_event());
+    }
+
+    /**
+     * Completes the operation *handle points to with operation_aborted if
+     * it is still pending; see operation::set_cancellation_handle().
+     */
+    void cancel_operation(operation **handle)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        if (!*handle)
+            return;
+        auto it = std::find_if(operations_.begin(), operations_.end(),
+            [handle](const operation_ptr &op) { return op.get() == *handle; });
+        operation_ptr op(std::move(*it));
+        operations_.erase(it);
+        finish(std::move(op), boost::asio::error::operation_aborted, dir_monitor_event());
+    }
+
+    dir_monitor_event popfront_event(boost::system::error_code &ec)
+    {
+        std::unique_lock<std::mutex> lock(events_mutex_);
+        events_cond_.wait(lock, [this] { return !events_open_ || !events_.empty(); });
+        boost::optional<dir_monitor_event> ev = take_event(ec);
+        return ev ? *ev : dir_monitor_event();
+    }
+
+    /**
+     * Takes the oldest event if there is one, without waiting.
+     */
+    boost::optional<dir_monitor_event> try_popfront_event(boost::system::error_code &ec)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        return take_event(ec);
+    }
+
+    /**
+     * popfront_event() that gives up, returning nothing, after timeout.
+     */
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> popfront_event_for(const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        std::unique_lock<std::mutex> lock(events_mutex_);
+        events_cond_.wait_for(lock, timeout, [this] { return !events_open_ || !events_.empty(); });
+        return take_event(ec);
+    }
+
+    /**
+     * Moves up to max_events queued events to out under one lock; returns
+     * out past the last one.
+     */
+    template <typename OutputIterator>
+    OutputIterator drain_events(OutputIterator out, std::size_t max_events)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        for (; max_events != 0 && !events_.empty(); --max_events)
+        {
+            *out++ = std::move(events_.front());
+            events_.pop_front();
+        }
+        return out;
+    }
+
+    void pushback_event(dir_monitor_event ev)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        if (events_open_)
+        {
+            events_.push_back(std::move(ev));
+            events_cond_.notify_all();
+            complete_operations();
+        }
+    }
+
+private:
+    struct watched_directory
+    {
+        dir_monitor_options options;
+        dir_snapshot::dir_entry_map snapshot;
+        std::chrono::steady_clock::time_point next;
+        // Tells a listing taken meanwhile from one of a re-added directory.
+        unsigned long generation;
+        // Set once a failed listing was reported, until one succeeds.
+        bool failing = false;
+    };
+    typedef std::map<std::string, watched_directory> dirs_t;
+
+    // Called with mutex_ held.
+    std::chrono::milliseconds interval_of(const watched_directory &dir) const
+    {
+        return dir.options.poll_interval.count() != 0 ? dir.options.poll_interval : interval_;
+    }
+
+    // Called with events_mutex_ held; events left at destroy() are still handed out.
+    boost::optional<dir_monitor_event> take_event(boost::system::error_code &ec)
+    {
+        ec = boost::system::error_code();
+        if (events_.empty())
+        {
+            if (!events_open_)
+                ec = boost::asio::error::operation_aborted;
+            return boost::none;
+        }
+        dir_monitor_event ev = std::move(events_.front());
+        events_.pop_front();
+        return ev;
+    }
+
+    // Called with events_mutex_ held.
+    void complete_operations()
+    {
+        while (!operations_.empty())
+        {
+            boost::system::error_code ec;
+            boost::optional<dir_monitor_event> ev = take_event(ec);
+            if (!ev && !ec)
+                break;
+            operation_ptr op(std::move(operations_.front()));
+            operations_.pop_front();
+            finish(std::move(op), ec, ev ? *ev : dir_monitor_event());
+        }
+    }
+
+    // Called with events_mutex_ held.
+    static void finish(operation_ptr op, const boost::system::error_code &ec, const dir_monitor_event &ev)
+    {
+        if (op->handle_)
+            *op->handle_ = nullptr;
+        op->complete(ec, ev);
+    }
+
+    struct scan_result
+    {
+        scan_result(const std::string &dir, unsigned long gen)
+            : dirname(dir),
+            generation(gen)
+        {
+        }
+
+        std::string dirname;
+        unsigned long generation;
+        dir_snapshot::dir_entry_map snapshot;
+        boost::system::error_code ec;
+    };
+
+    void work_thread()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (run_)
+        {
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            std::chrono::steady_clock::time_point next = now + interval_;
+            std::vector<scan_result> scans;
+            for (const auto &dir : dirs_)
+            {
+                if (dir.second.next <= now)
+                    scans.push_back(scan_result(dir.first, dir.second.generation));
+                else
+                    next = (std::min)(next, dir.second.next);
+            }
+            if (scans.empty())
+            {
+                cond_.wait_until(lock, next);
+                continue;
+            }
+
+            // Directories are listed unlocked, so adding, removing or
+            // reconfiguring them and setting the interval do not wait for
+            // a scan of a large tree.
+            lock.unlock();
+            for (auto &scan : scans)
+                dir_snapshot::scan(scan.dirname, scan.snapshot, scan.ec);
+            lock.lock();
+
+            for (auto &scan : scans)
+            {
+                dirs_t::iterator it = dirs_.find(scan.dirname);
+                // Removed or added again while it was listed.
+                if (it == dirs_.end() || it->second.generation != scan.generation)
+                    continue;
+                poll(scan, it->second);
+                it->second.next = std::chrono::steady_clock::now() + interval_of(it->second);
+            }
+        }
+    }
+
+    // Called with mutex_ held.
+    void poll(scan_result &scan, watched_directory &dir)
+    {
+        boost::system::error_code exists_ec;
+        if (scan.ec && boost::filesystem::exists(scan.dirname, exists_ec))
+        {
+            // The listing is incomplete, so it is not compared: what is
+            // missing would show as removed. The next interval tries again;
+            // until one succeeds, the directory has to be rescanned by the
+            // user, which is reported once.
+            if (!dir.failing)
+            {
+                dir.failing = true;
+                deliver(dir_monitor_event(scan.dirname, dir_monitor_event::recursive_rescan), dir.options);
+            }
+            return;
+        }
+
+        // A directory that is gone has lost everything in it.
+        dir.failing = false;
+        dir_snapshot::compare(dir.snapshot, scan.snapshot, dir.options.events, [this, &dir](const dir_monitor_event &ev)
+        {
+            deliver(ev, dir.options);
+        });
+        dir.snapshot.swap(scan.snapshot);
+    }
+
+    void deliver(const dir_monitor_event &ev, const dir_monitor_options &options)
+    {
+        if (sink_)
+            sink_(ev, options);
+        else
+            pushback_event(ev);
+    }
+
+    sink_type sink_;
+
+    // Guards everything up to the queue.
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    dirs_t dirs_;
+    std::chrono::milliseconds interval_;
+    bool run_;
+    unsigned long generations_;
+
+    std::mutex events_mutex_;
+    std::condition_variable events_cond_;
+    std::deque<dir_monitor_event> events_;
+    bool events_open_;
+    std::deque<operation_ptr> operations_;
+
+    // Started last, once everything it uses is constructed.
+    std::thread thread_;
+};
+
+}
+}
@@ -0,0 +1,146 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "../basic_dir_monitor.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/predef/os.h>
+#include <boost/system/error_code.hpp>
+
+#include <ctime>
+#include <map>
+#include <string>
+
+#if !BOOST_OS_WINDOWS
+#  include <sys/stat.h>
+#endif
+
+namespace boost {
+namespace asio {
+
+/**
+ * Recursive listing of a directory, and the comparison of two listings
+ * taken at different times: the engine behind polling, for file systems
+ * that report no changes of their own.
+ *
+ * Only what the listing holds is compared, so renames show as a removal
+ * and an addition, and a file rewritten with the same size within the
+ * resolution of its modification time (a nanosecond on most POSIX file
+ * systems, their timestamp granularity in practice) goes unnoticed.
+ */
+class dir_snapshot
+{
+public:
+    struct entry
+    {
+        bool directory;
+        // Nanoseconds are zero where the platform reports none.
+        std::time_t mtime_sec;
+        long mtime_nsec;
+        boost::uintmax_t size;
+    };
+
+    // Full paths, so that entries in subdirectories are reported under them.
+    typedef std::map<std::string, entry> dir_entry_map;
+
+    /**
+     * Lists dir and everything below it into entries. ec is set if a
+     * directory cannot be listed, and entries is incomplete then; entries
+     * vanishing meanwhile are skipped. Directories that may not be read
+     * are listed as empty.
+     */
+    static void scan(const std::string &dir, dir_entry_map &entries, boost::system::error_code &ec)
+    {
+        boost::filesystem::recursive_directory_iterator it(dir, boost::filesystem::directory_options::skip_permission_denied, ec);
+        boost::filesystem::recursive_directory_iterator end;
+        while (!ec && it != end)
+        {
+            boost::system::error_code entry_ec;
+            const boost::filesystem::path &path = it->path();
+            entry e;
+            e.directory = boost::filesystem::is_directory(it->symlink_status(entry_ec));
+            if (!entry_ec && stat_entry(path, e))
+                entries[path.string()] = e;
+            it.increment(ec);
+        }
+    }
+
+    /**
+     * Fills in the modification time, to the nanosecond where the platform
+     * has it, and the size of the file at path. Returns false if it is gone.
+     */
+    static bool stat_entry(const boost::filesystem::path &path, entry &e)
+    {
+#if BOOST_OS_WINDOWS
+        boost::system::error_code ec;
+        e.mtime_sec = boost::filesystem::last_write_time(path, ec);
+        e.mtime_nsec = 0;
+        e.size = !e.directory ? boost::filesystem::file_size(path, ec) : 0;
+        return !ec;
+#else
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            return false;
+        e.mtime_sec = st.st_mtime;
+#  if BOOST_OS_MACOS
+        e.mtime_nsec = st.st_mtimespec.tv_nsec;
+#  else
+        e.mtime_nsec = st.st_mtim.tv_nsec;
+#  endif
+        e.size = !e.directory ? st.st_size : 0;
+        return true;
+#endif
+    }
+
+    /**
+     * Calls sink(dir_monitor_event) for every difference between the two
+     * listings that events (dir_monitor_options::event_class bits) selects:
+     * added and removed entries, and modified files. Directories are not
+     * reported as modified when their entries change, as inotify does not.
+     */
+    template <typename Sink>
+    static void compare(const dir_entry_map &old_entries, const dir_entry_map &new_entries, unsigned events, Sink sink)
+    {
+        const bool created_removed = (events & dir_monitor_options::created_removed) != 0;
+        const bool modifications = (events & (dir_monitor_options::modifications | dir_monitor_options::close_write)) != 0;
+        for (dir_entry_map::const_iterator itn = new_entries.begin(); itn != new_entries.end(); ++itn)
+        {
+            dir_entry_map::const_iterator ito = old_entries.find(itn->first);
+            if (ito == old_entries.end())
+            {
+                if (created_removed)
+                    sink(dir_monitor_event(itn->first, dir_monitor_event::added));
+            }
+            else if (ito->second.directory != itn->second.directory)
+            {
+                // Replaced by an entry of another kind.
+                if (created_removed)
+                {
+                    sink(dir_monitor_event(itn->first, dir_monitor_event::removed));
+                    sink(dir_monitor_event(itn->first, dir_monitor_event::added));
+                }
+            }
+            else if (!itn->second.directory && modifications &&
+                (ito->second.mtime_sec != itn->second.mtime_sec || ito->second.mtime_nsec != itn->second.mtime_nsec ||
+                ito->second.size != itn->second.size))
+            {
+                sink(dir_monitor_event(itn->first, dir_monitor_event::modified));
+            }
+        }
+        if (!created_removed)
+            return;
+        for (dir_entry_map::const_iterator ito = old_entries.begin(); ito != old_entries.end(); ++ito)
+        {
+            if (new_entries.find(ito->first) == new_entries.end())
+                sink(dir_monitor_event(ito->first, dir_monitor_event::removed));
+        }
+    }
+};
+
+}
+}
@@ -149,6 +149,23 @@ public:
         return impl->popfront_event(ec);
     }
 
+    boost::optional<dir_monitor_event> try_monitor(implementation_type &impl, boost::system::error_code &ec)
+    {
+        return impl->try_popfront_event(ec);
+    }
+
+    template <typename Rep, typename Period>
+    boost::optional<dir_monitor_event> monitor_for(implementation_type &impl, const std::chrono::duration<Rep, Period> &timeout, boost::system::error_code &ec)
+    {
+        return impl->popfront_event_for(timeout, ec);
+    }
+
+    template <typename OutputIterator>
+    OutputIterator drain(implementation_type &impl, OutputIterator out, std::size_t max_events)
+    {
+        return impl->drain_events(out, max_events);
+    }
+
     template <typename Handler>
     class monitor_operation
     {
@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2008, 2009 Boris Schaeling <boris@highscore.de>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Micro-benchmark for the inotify read path parser: feeds synthetic
+// inotify_event records through inotify_event_buffer and reports how many
+// events per second are parsed. The previous string-append/erase parser is
+// measured alongside for comparison.
+//
+#include "dir_monitor/inotify/inotify_event_buffer.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Builds a stream of records the way the kernel lays them out: each name is
+// NUL-padded so that the next record stays aligned.
+std::vector<char> make_records(std::size_t count)
+{
+    std::vector<char> stream;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::string name = "file-" + std::to_string(i) + ".txt";
+        std::size_t len = (name.size() + 1 + alignof(inotify_event) - 1) & ~(alignof(inotify_event) - 1);
+
+        inotify_event iev;
+        std::memset(&iev, 0, sizeof(iev));
+        iev.wd = 1;
+        iev.mask = IN_MODIFY;
+        iev.len = static_cast<uint32_t>(len);
+
+        std::size_t offset = stream.size();
+        stream.resize(offset + sizeof(iev) + len, '\0');
+        std::memcpy(&stream[offset], &iev, sizeof(iev));
+        std::memcpy(&stream[offset + sizeof(iev)], name.data(), name.size());
+    }
+    return stream;
+}
+
+// Hands out the stream in chunks of at most read_size bytes, splitting
+// records at arbitrary points like a short read would.
+template <typename Parser>
+std::size_t run(const std::vector<char> &stream, std::size_t read_size, std::size_t rounds, Parser parser)
+{
+    std::size_t events = 0;
+    for (std::size_t round = 0; round < rounds; ++round)
+    {
+        for (std::size_t offset = 0; offset < stream.size(); )
+            offset += parser(stream.data() + offset, (std::min)(read_size, stream.size() - offset), events);
+    }
+    return events;
+}
+
+void report(const char *name, std::size_t events, std::chrono::steady_clock::duration elapsed)
+{
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << name << ": " << events << " events in " << seconds << " s, "
+        << static_cast<std::size_t>(events / seconds) << " events/s" << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    const std::size_t records = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    const std::size_t read_size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4096;
+    const std::size_t rounds = 10;
+
+    const std::vector<char> stream = make_records(records);
+    std::cout << records << " records, " << stream.size() << " bytes, " << read_size << " bytes per read" << std::endl;
+
+    {
+        boost::asio::inotify_event_buffer buffer(read_size + boost::asio::inotify_event_buffer::min_capacity());
+        std::size_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::size_t events = run(stream, read_size, rounds, [&](const char *data, std::size_t size, std::size_t &events) {
+            boost::asio::mutable_buffer free_space = *buffer.prepare().begin();
+            std::size_t n = (std::min)(size, boost::asio::buffer_size(free_space));
+            std::memcpy(boost::asio::buffer_cast<char*>(free_space), data, n);
+            events += buffer.commit(n, [&](const inotify_event &iev) { checksum += iev.len; });
+            return n;
+        });
+        report("inotify_event_buffer", events, std::chrono::steady_clock::now() - start);
+        if (checksum == 0)
+            return EXIT_FAILURE;
+    }
+
+    {
+        std::string pending;
+        std::size_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::size_t events = run(stream, read_size, rounds, [&](const char *data, std::size_t size, std::size_t &events) {
+            pending += std::string(data, size);
+            while (pending.size() >= sizeof(inotify_event))
+            {
+                const inotify_event *iev = reinterpret_cast<const inotify_event*>(pending.data());
+                if (pending.size() < sizeof(inotify_event) + iev->len)
+                    break;
+                checksum += iev->len;
+                ++events;
+                pending.erase(0, sizeof(inotify_event) + iev->len);
+            }
+            return size;
+        });
+        report("string append/erase", events, std::chrono::steady_clock::now() - start);
+        if (checksum == 0)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
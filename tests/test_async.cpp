@@ -9,6 +9,9 @@
 #include "dir_monitor/dir_monitor.hpp"
 #include "check_paths.hpp"
 #include "directory.hpp"
+#include <fstream>
+#include <future>
+#include <thread>
 
 boost::asio::io_service io_service;
 
@@ -133,6 +136,62 @@ BOOST_AUTO_TEST_CASE(multiple_events)
     io_service.reset();
 }
 
+#if BOOST_OS_LINUX
+void batch_handler(const boost::filesystem::path& expected_path, const boost::system::error_code &ec, const std::vector<boost::asio::dir_monitor_event> &events)
+{
+    BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+    BOOST_REQUIRE(!events.empty());
+    BOOST_CHECK_LE(events.size(), 2u);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events.front().path, expected_path);
+    BOOST_CHECK_EQUAL(events.front().type, boost::asio::dir_monitor_event::added);
+}
+
+BOOST_AUTO_TEST_CASE(batch_events)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    dir.create_file(TEST_FILE2);
+
+    dm.async_monitor_batch(2, boost::bind(&batch_handler, boost::ref(test_file1), _1, _2));
+    io_service.run();
+    io_service.reset();
+}
+
+void add_directory_handler(std::size_t &directories, boost::system::error_code &result, const boost::system::error_code &ec, std::size_t count)
+{
+    result = ec;
+    directories = count;
+}
+
+BOOST_AUTO_TEST_CASE(async_add_directory)
+{
+    directory dir(TEST_DIR1);
+    boost::filesystem::create_directories(boost::filesystem::path(TEST_DIR1) / "a" / "b");
+
+    boost::asio::dir_monitor dm(io_service);
+    std::size_t directories = 0;
+    boost::system::error_code ec;
+    dm.async_add_directory(TEST_DIR1, boost::asio::dir_monitor_options(),
+        boost::bind(&add_directory_handler, boost::ref(directories), boost::ref(ec), _1, _2));
+    io_service.run();
+    io_service.reset();
+    BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+    BOOST_CHECK_EQUAL(directories, 3u);
+    BOOST_CHECK_EQUAL(dm.watched_directories(TEST_DIR1).size(), 3u);
+
+    dm.async_add_directory(TEST_DIR1 "/missing", boost::asio::dir_monitor_options(),
+        boost::bind(&add_directory_handler, boost::ref(directories), boost::ref(ec), _1, _2));
+    io_service.run();
+    io_service.reset();
+    BOOST_CHECK_EQUAL(ec, boost::system::errc::not_a_directory);
+    BOOST_CHECK_EQUAL(directories, 0u);
+}
+#endif
+
 void aborted_async_call_handler(const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
 {
     BOOST_CHECK_EQUAL(ec, boost::asio::error::operation_aborted);
@@ -249,3 +308,460 @@ BOOST_AUTO_TEST_CASE(two_dir_monitors)
     t.join();
     io_service.reset();
 }
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(idle_dir_monitor)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    {
+        boost::asio::dir_monitor dm1(io_service);
+        dm1.add_directory(TEST_DIR1);
+
+        boost::asio::dir_monitor dm2(io_service);
+        dm2.add_directory(TEST_DIR2);
+
+        dm1.async_monitor(two_dir_monitors_handler);
+
+        auto test_file1 = dir2.create_file(TEST_FILE1);
+        dm2.async_monitor(boost::bind(&create_file_handler, boost::ref(test_file1), _1, _2));
+
+        // dm1 waiting for an event does not hold up dm2.
+        BOOST_CHECK_EQUAL(io_service.run_one(), 1u);
+    }
+
+    io_service.run();
+    io_service.reset();
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(idle_polling_dir_monitor)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    {
+        boost::asio::polling_dir_monitor dm1(io_service);
+        dm1.set_poll_interval(std::chrono::milliseconds(20));
+        dm1.add_directory(TEST_DIR1);
+
+        boost::asio::polling_dir_monitor dm2(io_service);
+        dm2.set_poll_interval(std::chrono::milliseconds(20));
+        dm2.add_directory(TEST_DIR2);
+
+        dm1.async_monitor(two_dir_monitors_handler);
+
+        auto test_file1 = dir2.create_file(TEST_FILE1);
+        dm2.async_monitor(boost::bind(&create_file_handler, boost::ref(test_file1), _1, _2));
+
+        // dm1 waiting for an event does not hold up dm2.
+        BOOST_CHECK_EQUAL(io_service.run_one_for(std::chrono::seconds(10)), 1u);
+    }
+
+    // Destroying dm1 aborts its call.
+    io_service.run();
+    io_service.reset();
+}
+
+BOOST_AUTO_TEST_CASE(polling_handler_executor)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::polling_dir_monitor dm(io_service);
+    dm.set_poll_interval(std::chrono::milliseconds(20));
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+
+    auto strand = boost::asio::make_strand(io_service);
+    bool done = false;
+    std::unique_ptr<int> token(new int(42));
+    dm.async_monitor(boost::asio::bind_executor(strand,
+        [&, token = std::move(token)](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+        {
+            create_file_handler(test_file1, ec, ev);
+            BOOST_CHECK_EQUAL(*token, 42);
+            BOOST_CHECK(strand.running_in_this_thread());
+            done = true;
+        }));
+    io_service.run();
+    io_service.reset();
+
+    BOOST_CHECK(done);
+}
+
+#if BOOST_OS_LINUX
+void inline_handler(const boost::filesystem::path& expected_path, bool &done, const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+{
+    create_file_handler(expected_path, ec, ev);
+    done = true;
+}
+
+BOOST_AUTO_TEST_CASE(inline_dir_monitor)
+{
+    directory dir(TEST_DIR1);
+
+    {
+        boost::asio::inline_dir_monitor dm(io_service);
+        dm.add_directory(TEST_DIR1);
+
+        auto test_file1 = dir.create_file(TEST_FILE1);
+
+        bool done = false;
+        dm.async_monitor(boost::bind(&inline_handler, boost::ref(test_file1), boost::ref(done), _1, _2));
+
+        // The pending read keeps run() from returning; this thread does all the work.
+        while (!done && io_service.run_one())
+            ;
+        BOOST_CHECK(done);
+    }
+
+    io_service.poll();
+    io_service.reset();
+}
+
+BOOST_AUTO_TEST_CASE(inline_dir_monitor_threads)
+{
+    directory dir(TEST_DIR1);
+
+    {
+        boost::asio::inline_dir_monitor dm(io_service);
+        dm.set_coalescing(std::chrono::milliseconds(5), true);
+        dm.add_directory(TEST_DIR1);
+
+        std::mutex mutex;
+        std::vector<boost::asio::dir_monitor_event> events;
+        std::function<void(const boost::system::error_code&, const boost::asio::dir_monitor_event&)> handler;
+        handler = [&](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+        {
+            if (ec)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                events.push_back(ev);
+                if (events.size() == 20)
+                {
+                    io_service.stop();
+                    return;
+                }
+            }
+            dm.async_monitor(handler);
+        };
+        dm.async_monitor(handler);
+
+        // Reads, timers and listing merges are spread over four threads.
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+            threads.emplace_back([] { io_service.run(); });
+        for (int i = 0; i < 20; ++i)
+            boost::filesystem::create_directory(boost::filesystem::path(TEST_DIR1) / std::to_string(i));
+        for (auto &thread : threads)
+            thread.join();
+        BOOST_CHECK_EQUAL(events.size(), 20u);
+    }
+
+    io_service.reset();
+    io_service.poll();
+    io_service.reset();
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(inline_dir_monitor_destroy_running)
+{
+    directory dir(TEST_DIR1);
+
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([] { io_service.run(); });
+
+    // Each monitor goes while the other threads may be reading records for it.
+    for (int round = 0; round < 20; ++round)
+    {
+        boost::asio::inline_dir_monitor dm(io_service);
+        dm.add_directory(TEST_DIR1);
+        dm.async_monitor([](const boost::system::error_code &, const boost::asio::dir_monitor_event &) {});
+        for (int i = 0; i < 50; ++i)
+            std::ofstream((boost::filesystem::path(TEST_DIR1) / (std::to_string(round) + "_" + std::to_string(i))).string().c_str());
+    }
+
+    work.reset();
+    for (auto &thread : threads)
+        thread.join();
+    io_service.reset();
+}
+#endif
+
+#if BOOST_OS_LINUX
+void record_event_handler(std::mutex &mutex, std::vector<boost::asio::dir_monitor_event> &events, const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(ev);
+}
+
+BOOST_AUTO_TEST_CASE(dispatch_strands)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+    dm.set_dispatch_strands(4);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    dir.write_file(TEST_FILE1, TEST_FILE2);
+
+    std::mutex mutex;
+    std::vector<boost::asio::dir_monitor_event> events;
+    dm.async_monitor(boost::bind(&record_event_handler, boost::ref(mutex), boost::ref(events), _1, _2));
+    dm.async_monitor(boost::bind(&record_event_handler, boost::ref(mutex), boost::ref(events), _1, _2));
+
+    // Both handlers may run at once, but events for one file run in order.
+    boost::thread t(boost::bind(&boost::asio::io_service::run, boost::ref(io_service)));
+    io_service.run();
+    t.join();
+    io_service.reset();
+
+    BOOST_REQUIRE_EQUAL(events.size(), 2u);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[0].path, test_file1);
+    BOOST_CHECK_EQUAL(events[0].type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[1].path, test_file1);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::modified);
+}
+
+BOOST_AUTO_TEST_CASE(dispatch_strands_then_sync)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+    dm.set_dispatch_strands(64);
+
+    // Waits for every event to be queued before asking for them.
+    const std::size_t count = 8;
+    std::size_t queued = 0;
+    dm.set_high_watermark(count, [&queued](std::size_t n) { queued = n; });
+    std::vector<boost::filesystem::path> files;
+    for (std::size_t i = 0; i < count; ++i)
+        files.push_back(dir.create_file(std::to_string(i).c_str()));
+    {
+        boost::asio::io_service::work work(io_service);
+        BOOST_REQUIRE_EQUAL(io_service.run_one(), 1u);
+    }
+    io_service.reset();
+    BOOST_REQUIRE_EQUAL(queued, count);
+
+    // Eight files do not all hash to one of 64 strands, so the batch stops
+    // short at a file of another strand; the event it stopped at must come
+    // next for synchronous calls too.
+    std::vector<boost::asio::dir_monitor_event> events;
+    dm.async_monitor_batch(count, [&events](const boost::system::error_code &ec, const std::vector<boost::asio::dir_monitor_event> &batch)
+    {
+        BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+        events.insert(events.end(), batch.begin(), batch.end());
+    });
+    BOOST_REQUIRE_EQUAL(io_service.run_one(), 1u);
+    io_service.reset();
+    BOOST_CHECK_GE(events.size(), 1u);
+    BOOST_CHECK_LT(events.size(), count);
+    while (events.size() < count)
+    {
+        boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(10));
+        BOOST_REQUIRE(ev);
+        events.push_back(*ev);
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+        BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[i].path, files[i]);
+    BOOST_CHECK(!dm.try_monitor());
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(move_only_handler)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    int calls = 0;
+    std::unique_ptr<int> token(new int(42));
+    dm.async_monitor([&, token = std::move(token)](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev) mutable
+    {
+        create_file_handler(test_file1, ec, ev);
+        BOOST_CHECK_EQUAL(*token, 42);
+        ++calls;
+        // Re-armed with the same move-only state.
+        dm.async_monitor([&, token = std::move(token)](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+        {
+            create_file_handler(test_file2, ec, ev);
+            BOOST_CHECK_EQUAL(*token, 42);
+            ++calls;
+        });
+    });
+    io_service.run();
+    io_service.reset();
+
+    BOOST_CHECK_EQUAL(calls, 2);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(future_completion_token)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    std::future<boost::asio::dir_monitor_event> ev = dm.async_monitor(boost::asio::use_future);
+    std::future<std::vector<boost::asio::dir_monitor_event> > batch = dm.async_monitor_batch(1, boost::asio::use_future);
+    std::thread runner([] { io_service.run(); });
+
+    create_file_handler(test_file1, boost::system::error_code(), ev.get());
+    std::vector<boost::asio::dir_monitor_event> events = batch.get();
+    BOOST_REQUIRE_EQUAL(events.size(), 1u);
+    create_file_handler(test_file2, boost::system::error_code(), events.front());
+
+    runner.join();
+    io_service.reset();
+}
+#endif
+
+#if BOOST_OS_LINUX && defined(BOOST_ASIO_HAS_CO_AWAIT)
+boost::asio::awaitable<void> await_events(boost::asio::dir_monitor &dm, boost::filesystem::path test_file1, boost::filesystem::path test_file2)
+{
+    boost::asio::dir_monitor_event ev = co_await dm.async_monitor(boost::asio::use_awaitable);
+    create_file_handler(test_file1, boost::system::error_code(), ev);
+    std::vector<boost::asio::dir_monitor_event> events = co_await dm.async_monitor_batch(1, boost::asio::use_awaitable);
+    BOOST_REQUIRE_EQUAL(events.size(), 1u);
+    create_file_handler(test_file2, boost::system::error_code(), events.front());
+}
+
+BOOST_AUTO_TEST_CASE(awaitable_completion_token)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    bool done = false;
+    boost::asio::co_spawn(io_service, await_events(dm, test_file1, test_file2),
+        [&done](std::exception_ptr e) { BOOST_CHECK(!e); done = true; });
+    io_service.run();
+    io_service.reset();
+
+    BOOST_CHECK(done);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(cancel_async_call)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    dm.async_monitor(aborted_async_call_handler);
+    dm.async_monitor_batch(4, [](const boost::system::error_code &ec, const std::vector<boost::asio::dir_monitor_event> &events)
+    {
+        BOOST_CHECK_EQUAL(ec, boost::asio::error::operation_aborted);
+        BOOST_CHECK(events.empty());
+    });
+    dm.cancel();
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    io_service.run();
+    io_service.reset();
+
+    // The monitor keeps running; the event is still there for the next call.
+    dm.async_monitor(boost::bind(&create_file_handler, boost::ref(test_file1), _1, _2));
+    io_service.run();
+    io_service.reset();
+}
+#endif
+
+#if BOOST_OS_LINUX && BOOST_VERSION >= 107700
+BOOST_AUTO_TEST_CASE(cancellation_slot)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    boost::asio::cancellation_signal signal;
+    bool cancelled = false;
+    dm.async_monitor(boost::asio::bind_cancellation_slot(signal.slot(),
+        [&cancelled](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &)
+        {
+            BOOST_CHECK_EQUAL(ec, boost::asio::error::operation_aborted);
+            cancelled = true;
+        }));
+    bool done = false;
+    dm.async_monitor([&done](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+    {
+        BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+        done = true;
+    });
+
+    // Only the first call is cancelled; the second one stays pending.
+    signal.emit(boost::asio::cancellation_type::terminal);
+    io_service.poll();
+    io_service.reset();
+    BOOST_CHECK(cancelled);
+    BOOST_CHECK(!done);
+
+    dir.create_file(TEST_FILE1);
+    io_service.run();
+    io_service.reset();
+    BOOST_CHECK(done);
+}
+
+BOOST_AUTO_TEST_CASE(polling_cancellation_slot)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::polling_dir_monitor dm(io_service);
+    dm.set_poll_interval(std::chrono::milliseconds(20));
+    dm.add_directory(TEST_DIR1);
+
+    boost::asio::cancellation_signal signal;
+    bool cancelled = false;
+    dm.async_monitor(boost::asio::bind_cancellation_slot(signal.slot(),
+        [&cancelled](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &)
+        {
+            BOOST_CHECK_EQUAL(ec, boost::asio::error::operation_aborted);
+            cancelled = true;
+        }));
+    bool done = false;
+    dm.async_monitor([&done](const boost::system::error_code &ec, const boost::asio::dir_monitor_event &ev)
+    {
+        BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+        done = true;
+    });
+
+    signal.emit(boost::asio::cancellation_type::terminal);
+    io_service.poll();
+    io_service.reset();
+    BOOST_CHECK(cancelled);
+    BOOST_CHECK(!done);
+
+    dir.create_file(TEST_FILE1);
+    io_service.run();
+    io_service.reset();
+    BOOST_CHECK(done);
+}
+#endif
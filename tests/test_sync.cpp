@@ -10,6 +10,10 @@
 #include "dir_monitor/dir_monitor.hpp"
 #include "check_paths.hpp"
 #include "directory.hpp"
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <thread>
 
 boost::asio::io_service io_service;
 
@@ -109,6 +113,22 @@ BOOST_AUTO_TEST_CASE(multiple_events)
     BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
 }
 
+BOOST_AUTO_TEST_CASE(remove_sub_directory)
+{
+    directory dir(TEST_DIR1);
+    boost::filesystem::path sub_directory = boost::filesystem::initial_path() / TEST_DIR1 / "sub";
+    boost::filesystem::create_directory(sub_directory);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    boost::filesystem::remove(sub_directory);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, sub_directory);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+}
+
 BOOST_AUTO_TEST_CASE(dir_monitor_destruction)
 {
     directory dir(TEST_DIR1);
@@ -118,3 +138,838 @@ BOOST_AUTO_TEST_CASE(dir_monitor_destruction)
 
     dir.create_file(TEST_FILE1);
 }
+
+BOOST_AUTO_TEST_CASE(poll_events)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    boost::system::error_code ec;
+    BOOST_CHECK(!dm.try_monitor(ec));
+    BOOST_CHECK(!ec);
+    BOOST_CHECK(!dm.monitor_for(std::chrono::milliseconds(10)));
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(10));
+    BOOST_REQUIRE(ev);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev->path, test_file1);
+    BOOST_CHECK_EQUAL(ev->type, boost::asio::dir_monitor_event::added);
+
+    auto test_file2 = dir.rename_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+    std::vector<boost::asio::dir_monitor_event> events;
+    while (events.size() < 3)
+    {
+        // At most two at a time, whatever is queued.
+        const std::size_t drained = events.size();
+        dm.drain(std::back_inserter(events), 2);
+        BOOST_REQUIRE_LE(events.size() - drained, 2u);
+        if (events.size() == drained)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    BOOST_CHECK_EQUAL(events[0].type, boost::asio::dir_monitor_event::renamed_old_name);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::renamed_new_name);
+    BOOST_CHECK_EQUAL(events[2].type, boost::asio::dir_monitor_event::removed);
+    BOOST_CHECK(!dm.try_monitor());
+}
+
+BOOST_AUTO_TEST_CASE(polling_monitor)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::polling_dir_monitor dm(io_service);
+    dm.set_poll_interval(std::chrono::milliseconds(20));
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(10));
+    BOOST_REQUIRE(ev);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev->path, test_file1);
+    BOOST_CHECK_EQUAL(ev->type, boost::asio::dir_monitor_event::added);
+
+    dir.write_file(TEST_FILE1, "polled");
+    ev = dm.monitor_for(std::chrono::seconds(10));
+    BOOST_REQUIRE(ev);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev->path, test_file1);
+    BOOST_CHECK_EQUAL(ev->type, boost::asio::dir_monitor_event::modified);
+
+    dir.remove_file(TEST_FILE1);
+    ev = dm.monitor_for(std::chrono::seconds(10));
+    BOOST_REQUIRE(ev);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev->path, test_file1);
+    BOOST_CHECK_EQUAL(ev->type, boost::asio::dir_monitor_event::removed);
+}
+
+BOOST_AUTO_TEST_CASE(polling_unreadable_sub_directory)
+{
+    directory dir(TEST_DIR1);
+    boost::filesystem::path sub_directory = boost::filesystem::initial_path() / TEST_DIR1 / "sub";
+    boost::filesystem::create_directory(sub_directory);
+    boost::filesystem::permissions(sub_directory, boost::filesystem::no_perms);
+    // Restored before dir is removed, even if add_directory() throws.
+    struct restore_permissions
+    {
+        ~restore_permissions() { boost::filesystem::permissions(path, boost::filesystem::owner_all); }
+        boost::filesystem::path path;
+    } restore = { sub_directory };
+
+    boost::asio::polling_dir_monitor dm(io_service);
+    dm.set_poll_interval(std::chrono::milliseconds(20));
+    dm.add_directory(TEST_DIR1);
+
+    // The tree is still listed, with the subdirectory as empty.
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(10));
+    BOOST_REQUIRE(ev);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev->path, test_file1);
+    BOOST_CHECK_EQUAL(ev->type, boost::asio::dir_monitor_event::added);
+}
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(read_statistics)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_read_buffer_size(4096, 64 * 1024);
+    dm.add_directory(TEST_DIR1);
+
+    const int files = 200;
+    for (int i = 0; i < files; ++i)
+        dir.create_file(("file" + std::to_string(i)).c_str());
+    for (int i = 0; i < files; ++i)
+        BOOST_CHECK_EQUAL(dm.monitor().type, boost::asio::dir_monitor_event::added);
+
+    boost::asio::dir_monitor_read_statistics stats = dm.read_statistics();
+    std::uint64_t histogram_reads = 0;
+    for (auto count : stats.histogram)
+        histogram_reads += count;
+    BOOST_CHECK_EQUAL(histogram_reads, stats.reads);
+    BOOST_CHECK_GE(stats.reads, stats.reactor_reads);
+    BOOST_CHECK_GE(stats.bytes, files * sizeof(inotify_event));
+    BOOST_CHECK_GE(stats.buffer_capacity, 4096u);
+    BOOST_CHECK_LE(stats.buffer_capacity, 64u * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(inotify_event_buffer_partial_record)
+{
+    // A record with a zero-length name followed by one carrying a name.
+    char records[2 * sizeof(inotify_event) + 16] = {};
+    inotify_event *first = reinterpret_cast<inotify_event*>(records);
+    first->wd = 1;
+    first->mask = IN_IGNORED;
+    inotify_event *second = reinterpret_cast<inotify_event*>(records + sizeof(inotify_event));
+    second->wd = 2;
+    second->mask = IN_CREATE;
+    second->len = 16;
+    std::strcpy(second->name, TEST_FILE1);
+
+    boost::asio::inotify_event_buffer buffer;
+    std::vector<int> wds;
+    auto collect = [&](const inotify_event &iev) { wds.push_back(iev.wd); };
+
+    // Deliver the stream one byte short of the end, then the last byte.
+    boost::asio::mutable_buffer free_space = *buffer.prepare().begin();
+    std::memcpy(boost::asio::buffer_cast<char*>(free_space), records, sizeof(records) - 1);
+    BOOST_CHECK_EQUAL(buffer.commit(sizeof(records) - 1, collect), 1u);
+    BOOST_CHECK_EQUAL(buffer.pending(), sizeof(inotify_event) + 15);
+
+    free_space = *buffer.prepare().begin();
+    std::memcpy(boost::asio::buffer_cast<char*>(free_space), records + sizeof(records) - 1, 1);
+    BOOST_CHECK_EQUAL(buffer.commit(1, collect), 1u);
+    BOOST_CHECK_EQUAL(buffer.pending(), 0u);
+
+    BOOST_REQUIRE_EQUAL(wds.size(), 2u);
+    BOOST_CHECK_EQUAL(wds[0], 1);
+    BOOST_CHECK_EQUAL(wds[1], 2);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(paired_rename)
+{
+    directory dir(TEST_DIR1);
+    auto test_file1 = dir.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_rename_pairing(std::chrono::milliseconds(100));
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file2 = dir.rename_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::renamed);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.old_path, test_file1);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+
+    ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+}
+
+BOOST_AUTO_TEST_CASE(unpaired_rename)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_rename_pairing(std::chrono::milliseconds(10));
+    dm.add_directory(TEST_DIR1);
+
+    boost::filesystem::rename(test_file1, boost::filesystem::initial_path() / TEST_DIR2 / TEST_FILE1);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+}
+
+BOOST_AUTO_TEST_CASE(unpaired_rename_timeout)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_rename_pairing(std::chrono::milliseconds(200));
+    dm.add_directory(TEST_DIR1);
+
+    // Records of other paths do not give up on the destination.
+    boost::filesystem::rename(test_file1, boost::filesystem::initial_path() / TEST_DIR2 / TEST_FILE1);
+    auto test_file2 = dir1.create_file(TEST_FILE2);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+
+    ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+}
+
+BOOST_AUTO_TEST_CASE(unpaired_rename_then_create)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_rename_pairing(std::chrono::milliseconds(200));
+    dm.add_directory(TEST_DIR1);
+
+    // Moved out and created again: the removal must not trail the addition.
+    boost::filesystem::rename(test_file1, boost::filesystem::initial_path() / TEST_DIR2 / TEST_FILE1);
+    dir1.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+
+    ev = dm.monitor();
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(close_write_only)
+{
+    directory dir(TEST_DIR1);
+    auto test_file1 = dir.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1, boost::asio::dir_monitor_options(boost::asio::dir_monitor_options::close_write));
+
+    dir.write_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE1);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    // One event per closed file; neither the writes nor the removal are reported.
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::modified);
+
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::modified);
+}
+
+BOOST_AUTO_TEST_CASE(attributes_only)
+{
+    directory dir(TEST_DIR1);
+    auto test_file1 = dir.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1, boost::asio::dir_monitor_options(boost::asio::dir_monitor_options::attributes));
+
+    dir.create_file(TEST_FILE2);
+    boost::filesystem::permissions(test_file1, boost::filesystem::owner_read | boost::filesystem::owner_write);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::metadata_changed);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(coalesce_modifications)
+{
+    directory dir(TEST_DIR1);
+    auto test_file1 = dir.create_file(TEST_FILE1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_coalescing(std::chrono::milliseconds(50));
+    dm.add_directory(TEST_DIR1);
+
+    for (int i = 0; i < 10; ++i)
+        dir.write_file(TEST_FILE1, TEST_FILE2);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::modified);
+
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+}
+
+BOOST_AUTO_TEST_CASE(coalesce_added_modified)
+{
+    directory dir(TEST_DIR1);
+    auto test_file2 = dir.create_file(TEST_FILE2);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_coalescing(std::chrono::milliseconds(50), true);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    dir.write_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+}
+
+BOOST_AUTO_TEST_CASE(coalesce_deadline_order)
+{
+    typedef boost::asio::dir_monitor_event_coalescer coalescer;
+    auto directory = std::make_shared<const boost::asio::dir_monitor_directory>(1, TEST_DIR1);
+    std::vector<std::string> released;
+    auto sink = [&released](const boost::asio::compact_dir_monitor_event &ev) { released.push_back(std::string(ev.name(), ev.name_size())); };
+
+    coalescer c;
+    c.configure(std::chrono::milliseconds(10), false);
+    const coalescer::clock::time_point start = coalescer::clock::now();
+    c.push(boost::asio::compact_dir_monitor_event(directory, "a", boost::asio::dir_monitor_event::modified), start, sink);
+    c.push(boost::asio::compact_dir_monitor_event(directory, "b", boost::asio::dir_monitor_event::modified), start, sink);
+    // a is written to again and falls due after b.
+    c.push(boost::asio::compact_dir_monitor_event(directory, "a", boost::asio::dir_monitor_event::modified), start + std::chrono::milliseconds(5), sink);
+
+    BOOST_CHECK(c.expire(start + std::chrono::milliseconds(10), sink) == start + std::chrono::milliseconds(15));
+    BOOST_REQUIRE_EQUAL(released.size(), 1u);
+    BOOST_CHECK_EQUAL(released[0], "b");
+
+    BOOST_CHECK(c.expire(start + std::chrono::milliseconds(15), sink) == coalescer::clock::time_point::max());
+    BOOST_REQUIRE_EQUAL(released.size(), 2u);
+    BOOST_CHECK_EQUAL(released[1], "a");
+    BOOST_CHECK(c.empty());
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(batch_events)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.rename_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+
+    std::vector<boost::asio::dir_monitor_event> events;
+    while (events.size() < 4)
+    {
+        std::vector<boost::asio::dir_monitor_event> batch = dm.monitor_batch(3);
+        BOOST_REQUIRE(!batch.empty());
+        BOOST_CHECK_LE(batch.size(), 3u);
+        events.insert(events.end(), batch.begin(), batch.end());
+    }
+
+    BOOST_REQUIRE_EQUAL(events.size(), 4u);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[0].path, test_file1);
+    BOOST_CHECK_EQUAL(events[0].type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[1].path, test_file1);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::renamed_old_name);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[2].path, test_file2);
+    BOOST_CHECK_EQUAL(events[2].type, boost::asio::dir_monitor_event::renamed_new_name);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[3].path, test_file2);
+    BOOST_CHECK_EQUAL(events[3].type, boost::asio::dir_monitor_event::removed);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(compact_events)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    const std::string long_name(boost::asio::compact_dir_monitor_event::inline_name_capacity + 10, 'x');
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto long_file = dir.create_file(long_name.c_str());
+
+    boost::asio::compact_dir_monitor_event ev = dm.monitor_compact();
+    BOOST_CHECK_EQUAL(std::string(ev.name()), TEST_FILE1);
+    BOOST_CHECK_EQUAL(ev.name_size(), std::strlen(TEST_FILE1));
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path(), test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+
+    boost::asio::compact_dir_monitor_event long_ev = dm.monitor_compact();
+    BOOST_CHECK_EQUAL(std::string(long_ev.name()), long_name);
+    BOOST_CHECK(long_ev.directory() == ev.directory());
+
+    boost::asio::dir_monitor_event view = long_ev;
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(view.path, long_file);
+    BOOST_CHECK_EQUAL(view.type, boost::asio::dir_monitor_event::added);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(watch_table_lookup)
+{
+    boost::asio::watch_table<std::string> table;
+    table.insert(1, "a", "first");
+    table.insert(5000, "b", "second");
+
+    BOOST_REQUIRE(table.find(1));
+    BOOST_CHECK_EQUAL(*table.find(1), "first");
+    BOOST_REQUIRE(table.find(5000));
+    BOOST_CHECK_EQUAL(*table.find(5000), "second");
+    BOOST_CHECK(!table.find(2));
+    BOOST_CHECK(!table.find(100000));
+    BOOST_CHECK_EQUAL(table.find(std::string("b")), 5000);
+
+    // Replacing keeps the old record readable until reclaim().
+    std::string *old = table.find(1);
+    table.insert(1, "c", "third");
+    BOOST_CHECK_EQUAL(*old, "first");
+    BOOST_CHECK_EQUAL(*table.find(1), "third");
+    BOOST_CHECK_EQUAL(table.find(std::string("a")), -1);
+    BOOST_CHECK_EQUAL(table.find(std::string("c")), 1);
+    table.reclaim();
+
+    BOOST_CHECK_EQUAL(table.erase(std::string("b")), 5000);
+    BOOST_CHECK(!table.find(5000));
+    BOOST_CHECK(!table.erase(5000));
+    BOOST_REQUIRE_EQUAL(table.descriptors().size(), 1u);
+    BOOST_CHECK_EQUAL(table.descriptors()[0], 1);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(watch_tree)
+{
+    directory dir(TEST_DIR1);
+    boost::filesystem::create_directories(boost::filesystem::path(TEST_DIR1) / "a" / "b");
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+    BOOST_CHECK_EQUAL(dm.watched_directories(TEST_DIR1).size(), 3u);
+    BOOST_REQUIRE_EQUAL(dm.watched_directories(TEST_DIR1 "/a").size(), 2u);
+    BOOST_CHECK_EQUAL(dm.watched_directories(TEST_DIR1 "/a")[0], TEST_DIR1 "/a");
+    BOOST_CHECK_EQUAL(dm.watched_directories(TEST_DIR1 "/a")[1], TEST_DIR1 "/a/b");
+
+    // A moved directory is watched under its new name only.
+    boost::filesystem::rename(boost::filesystem::path(TEST_DIR1) / "a", boost::filesystem::path(TEST_DIR1) / "c");
+    BOOST_CHECK_EQUAL(dm.monitor().type, boost::asio::dir_monitor_event::renamed_old_name);
+    BOOST_CHECK_EQUAL(dm.monitor().type, boost::asio::dir_monitor_event::renamed_new_name);
+    BOOST_CHECK(dm.watched_directories(TEST_DIR1 "/a").empty());
+    // The destination is registered off the reader thread.
+    for (int i = 0; i < 100 && dm.watched_directories(TEST_DIR1 "/c").size() < 2; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    BOOST_CHECK_EQUAL(dm.watched_directories(TEST_DIR1 "/c").size(), 2u);
+
+    // Removal needs nothing from the disk.
+    boost::filesystem::remove_all(boost::filesystem::path(TEST_DIR1) / "c");
+    dm.remove_directory(TEST_DIR1);
+    BOOST_CHECK(dm.watched_directories(TEST_DIR1).empty());
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(new_sub_directory_contents)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+
+    // Most of this exists before the watches on a, b and c are installed.
+    boost::filesystem::create_directories(boost::filesystem::path(TEST_DIR1) / "a" / "b" / "c");
+    // Changes the working directory while a, b and c are being watched.
+    auto test_file1 = dir.create_file("a/b/c/" TEST_FILE1);
+
+    std::set<boost::filesystem::path> added;
+    for (int i = 0; i < 4; ++i)
+    {
+        boost::asio::dir_monitor_event ev = dm.monitor();
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+        BOOST_CHECK(added.insert(boost::filesystem::relative(ev.path, boost::filesystem::initial_path())).second);
+    }
+    BOOST_CHECK(added.count(boost::filesystem::path(TEST_DIR1) / "a" / "b" / "c" / TEST_FILE1));
+
+    // Nothing is reported twice.
+    auto test_file2 = dir.create_file(TEST_FILE2);
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(shared_inotify_instance)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    boost::asio::shared_dir_monitor dm1(io_service);
+    dm1.add_directory(TEST_DIR1);
+    boost::asio::shared_dir_monitor dm2(io_service);
+    dm2.add_directory(TEST_DIR2);
+
+    boost::filesystem::path test_file1;
+    {
+        // Shares the watch on TEST_DIR1 with dm1, asking for other events.
+        boost::asio::shared_dir_monitor dm3(io_service);
+        dm3.add_directory(TEST_DIR1, boost::asio::dir_monitor_options(boost::asio::dir_monitor_options::close_write));
+
+        test_file1 = dir1.create_file(TEST_FILE1);
+
+        boost::asio::dir_monitor_event ev = dm3.monitor();
+        BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::modified);
+    }
+
+    auto test_file2 = dir2.create_file(TEST_FILE2);
+    dir1.remove_file(TEST_FILE1);
+
+    // Each monitor only sees its own directories and event classes, and the
+    // watch on TEST_DIR1 outlives dm3.
+    boost::asio::dir_monitor_event ev = dm1.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+
+    ev = dm1.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+
+    ev = dm2.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(event_queue_spill)
+{
+    boost::asio::event_queue<int> queue(2);
+
+    // The ring holds two; the rest spill and still come out in order.
+    for (int i = 0; i < 5; ++i)
+        BOOST_CHECK(queue.push(i));
+    int value = -1;
+    for (int i = 0; i < 5; ++i)
+    {
+        BOOST_REQUIRE(queue.try_pop(value));
+        BOOST_CHECK_EQUAL(value, i);
+    }
+    BOOST_CHECK(!queue.try_pop(value));
+
+    int late = 5;
+    BOOST_CHECK(queue.push(late));
+    BOOST_CHECK(queue.pop(value));
+    BOOST_CHECK_EQUAL(value, 5);
+
+    queue.close();
+    BOOST_CHECK(!queue.push(late));
+    BOOST_CHECK(!queue.pop(value));
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(queue_drop_oldest)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_queue_limit(2, boost::asio::queue_drop_oldest);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.rename_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+    // Let the reader queue all four events before any is taken.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::vector<boost::asio::dir_monitor_event> events = dm.monitor_batch(10);
+    BOOST_REQUIRE_EQUAL(events.size(), 2u);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[0].path, test_file2);
+    BOOST_CHECK_EQUAL(events[0].type, boost::asio::dir_monitor_event::renamed_new_name);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[1].path, test_file2);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::removed);
+}
+
+BOOST_AUTO_TEST_CASE(queue_rescan_directory)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_queue_limit(1, boost::asio::queue_rescan_directory);
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    dir.create_file(TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+
+    // Both events that did not fit collapse into one rescan, queued once there is room.
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, boost::filesystem::path(TEST_DIR1));
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::recursive_rescan);
+
+    auto test_file2 = dir.create_file(TEST_FILE2);
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+}
+
+BOOST_AUTO_TEST_CASE(queue_backpressure)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_queue_limit(2, boost::asio::queue_backpressure);
+    std::size_t queued = 0;
+    dm.set_high_watermark(2, [&queued](std::size_t n) { queued = n; });
+    dm.add_directory(TEST_DIR1);
+
+    auto test_file1 = dir.create_file(TEST_FILE1);
+    auto test_file2 = dir.rename_file(TEST_FILE1, TEST_FILE2);
+    dir.remove_file(TEST_FILE2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Nothing is lost: what does not fit waits in the kernel.
+    std::vector<boost::asio::dir_monitor_event> events;
+    while (events.size() < 4)
+    {
+        std::vector<boost::asio::dir_monitor_event> batch = dm.monitor_batch(1);
+        events.insert(events.end(), batch.begin(), batch.end());
+    }
+    BOOST_CHECK_EQUAL(events[0].type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::renamed_old_name);
+    BOOST_CHECK_EQUAL(events[2].type, boost::asio::dir_monitor_event::renamed_new_name);
+    BOOST_CHECK_EQUAL(events[3].type, boost::asio::dir_monitor_event::removed);
+
+    io_service.run();
+    io_service.reset();
+    BOOST_CHECK_GE(queued, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(queue_release_within_limit)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_queue_limit(2, boost::asio::queue_coalesce_per_path);
+    std::size_t queued = 0;
+    dm.set_high_watermark(3, [&queued](std::size_t n) { queued = n; });
+    dm.add_directory(TEST_DIR1);
+
+    for (int i = 0; i < 10; ++i)
+        dir.create_file(std::to_string(i).c_str());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Held events are let through as room is made, never beyond the limit.
+    for (int i = 0; i < 10; ++i)
+    {
+        boost::asio::dir_monitor_event ev = dm.monitor();
+        BOOST_CHECK_EQUAL(ev.path.filename().string(), std::to_string(i));
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+    }
+
+    io_service.poll();
+    io_service.reset();
+    BOOST_CHECK_EQUAL(queued, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(queue_backpressure_within_limit)
+{
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_queue_limit(2, boost::asio::queue_backpressure);
+    std::size_t queued = 0;
+    dm.set_high_watermark(3, [&queued](std::size_t n) { queued = n; });
+    dm.add_directory(TEST_DIR1);
+
+    // Read in one go, well past the limit.
+    for (int i = 0; i < 100; ++i)
+        dir.create_file(std::to_string(i).c_str());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // The records beyond the limit wait in the read buffer, in order.
+    for (int i = 0; i < 100; ++i)
+    {
+        boost::asio::dir_monitor_event ev = dm.monitor();
+        BOOST_CHECK_EQUAL(ev.path.filename().string(), std::to_string(i));
+        BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+    }
+
+    io_service.poll();
+    io_service.reset();
+    BOOST_CHECK_EQUAL(queued, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(queue_overflow_resync)
+{
+    std::ifstream max_queued_events("/proc/sys/fs/inotify/max_queued_events");
+    int limit = 0;
+    if (!(max_queued_events >> limit) || limit > 65536)
+        return;
+
+    directory dir(TEST_DIR1);
+
+    boost::asio::dir_monitor dm(io_service);
+    // The reader stops at once, so the kernel queue fills up behind it.
+    dm.set_queue_limit(1, boost::asio::queue_backpressure);
+    dm.add_directory(TEST_DIR1);
+
+    const int files = limit + 100;
+    for (int i = 0; i < files; ++i)
+        std::ofstream((boost::filesystem::path(TEST_DIR1) / std::to_string(i)).string().c_str());
+
+    // Files whose records were dropped are found by the resync.
+    bool overflow = false;
+    std::set<std::string> added;
+    while (boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(5)))
+    {
+        if (ev->type == boost::asio::dir_monitor_event::overflow)
+            overflow = true;
+        else if (ev->type == boost::asio::dir_monitor_event::added)
+            BOOST_CHECK(added.insert(ev->path.filename().string()).second);
+        if (overflow && added.size() == static_cast<std::size_t>(files))
+            break;
+    }
+    BOOST_CHECK(overflow);
+    BOOST_CHECK_EQUAL(added.size(), static_cast<std::size_t>(files));
+}
+
+BOOST_AUTO_TEST_CASE(priority_lanes)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1, boost::asio::dir_monitor_options(boost::asio::dir_monitor_options::default_events, boost::asio::priority_low));
+    dm.add_directory(TEST_DIR2, boost::asio::dir_monitor_options(boost::asio::dir_monitor_options::default_events, boost::asio::priority_high));
+    dm.set_starvation_limit(2);
+
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+    auto test_file2 = dir2.create_file(TEST_FILE1);
+    auto test_file3 = dir2.create_file(TEST_FILE2);
+    dir2.remove_file(TEST_FILE2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // The low priority event waits for two high priority ones, then cuts in.
+    boost::asio::dir_monitor_event ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file2);
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file3);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::added);
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file1);
+    ev = dm.monitor();
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(ev.path, test_file3);
+    BOOST_CHECK_EQUAL(ev.type, boost::asio::dir_monitor_event::removed);
+}
+
+BOOST_AUTO_TEST_CASE(inotify_instances)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.set_inotify_instances(2);
+    dm.add_directory(TEST_DIR1);
+    dm.add_directory(TEST_DIR2);
+
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+    auto test_file2 = dir2.create_file(TEST_FILE2);
+    dir1.remove_file(TEST_FILE1);
+
+    // Both instances feed the queue; each directory keeps its order.
+    std::vector<boost::asio::compact_dir_monitor_event> events;
+    while (events.size() < 3)
+    {
+        std::vector<boost::asio::compact_dir_monitor_event> batch = dm.monitor_batch_compact(3);
+        events.insert(events.end(), batch.begin(), batch.end());
+    }
+    std::vector<boost::asio::compact_dir_monitor_event> events1, events2;
+    for (const auto &ev : events)
+        (ev.directory()->path.filename() == TEST_DIR1 ? events1 : events2).push_back(ev);
+    BOOST_REQUIRE_EQUAL(events1.size(), 2u);
+    BOOST_CHECK_EQUAL(events1[0].type, boost::asio::dir_monitor_event::added);
+    BOOST_CHECK_EQUAL(events1[1].type, boost::asio::dir_monitor_event::removed);
+    BOOST_REQUIRE_EQUAL(events2.size(), 1u);
+    BOOST_CHECK_EQUAL(events2[0].type, boost::asio::dir_monitor_event::added);
+    // Watch descriptors repeat across instances, directory ids do not.
+    BOOST_CHECK_NE(events1[0].directory()->id, events2[0].directory()->id);
+}
+#endif
+
+#if BOOST_OS_LINUX
+BOOST_AUTO_TEST_CASE(polled_directory)
+{
+    directory dir1(TEST_DIR1);
+    directory dir2(TEST_DIR2);
+
+    boost::asio::dir_monitor dm(io_service);
+    dm.add_directory(TEST_DIR1);
+    boost::asio::dir_monitor_options polled;
+    polled.poll_interval = std::chrono::milliseconds(20);
+    dm.add_directory(TEST_DIR2, polled);
+
+    auto test_file1 = dir1.create_file(TEST_FILE1);
+    auto test_file2 = dir2.create_file(TEST_FILE2);
+    std::vector<boost::asio::dir_monitor_event> events;
+    for (int i = 0; i < 2; ++i)
+    {
+        boost::optional<boost::asio::dir_monitor_event> ev = dm.monitor_for(std::chrono::seconds(10));
+        BOOST_REQUIRE(ev);
+        events.push_back(*ev);
+    }
+    // The inotify watch reports right away, the polled one at its next listing.
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[0].path, test_file1);
+    BOOST_CHECK_THE_SAME_PATHS_RELATIVE(events[1].path, test_file2);
+    BOOST_CHECK_EQUAL(events[1].type, boost::asio::dir_monitor_event::added);
+
+    dm.remove_directory(TEST_DIR2);
+    dir2.remove_file(TEST_FILE2);
+    BOOST_CHECK(!dm.monitor_for(std::chrono::milliseconds(100)));
+}
+#endif